@@ -0,0 +1,82 @@
+/*
+ * arenatest.c - tests the arenas of mm.c over many reset cycles
+ *
+ * Each cycle fills an arena with objects of varying sizes, some larger
+ * than a chunk, checks that they are 8 byte aligned and do not overlap,
+ * and resets the arena. The statistics have to add up, a reset has to
+ * give every chunk back, and after the first cycle the heap must not
+ * grow any more. Exits with 1 at the first failure.
+ *
+ * usage: arenatest [cycles [objects per cycle]]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define CHUNK 65536
+
+static int cycles = 50, objects = 20000;
+static unsigned char **obj;
+
+static size_t size_of(int c, int i) {
+    //one object in 1000 does not fit in a chunk
+    return i % 1000 == 999 ? CHUNK + i : 1 + (i * 37 + c) % 300;
+}
+
+static int fail(const char *what) {
+    fprintf(stderr, "arenatest: %s\n", what);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    struct mm_arena_stats st;
+    mm_arena *a;
+    size_t heap = 0, used = 0, j;
+    int c, i;
+    if (argc > 1)
+        cycles = atoi(argv[1]);
+    if (argc > 2)
+        objects = atoi(argv[2]);
+    obj = calloc(objects, sizeof(*obj));
+    mem_init();
+    mm_init();
+    if ((a = mm_arena_create(CHUNK)) == NULL)
+        return fail("mm_arena_create failed");
+
+    for (c = 0; c < cycles; c++) {
+        for (i = 0; i < objects; i++) {
+            if ((obj[i] = mm_arena_alloc(a, size_of(c, i))) == NULL)
+                return fail("mm_arena_alloc failed");
+            if ((uintptr_t)obj[i] & 7)
+                return fail("object not 8 byte aligned");
+            memset(obj[i], (c + i) & 0xff, size_of(c, i));
+            used += (size_of(c, i) + 7) & ~(size_t)7;
+        }
+        //a later object overwriting an earlier one shows here
+        for (i = 0; i < objects; i++)
+            for (j = 0; j < size_of(c, i); j++)
+                if (obj[i][j] != ((c + i) & 0xff))
+                    return fail("objects overlap");
+        mm_arena_reset(a);
+        mm_arena_stats(a, &st);
+        if (st.held != 0 || st.resets != (size_t)c + 1)
+            return fail("reset did not give the chunks back");
+        if (st.allocs != (size_t)(c + 1) * objects || st.used != used)
+            return fail("arena statistics do not add up");
+        if (mm_checkheap(0))
+            return fail("heap corrupt after a reset");
+        if (c == 0)
+            heap = mem_heapsize();
+        else if (mem_heapsize() > heap)
+            return fail("the heap grew after the first cycle");
+    }
+    printf("%d cycles: %zu chunks, %zu KB used, %zu KB wasted, "
+           "peak %zu KB, heap %zu KB\n", cycles, st.chunks, st.used >> 10,
+           st.wasted >> 10, st.peak_held >> 10, heap >> 10);
+    mm_arena_destroy(a);
+    return mm_checkheap(0) ? fail("heap corrupt after destroy") : 0;
+}
@@ -0,0 +1,314 @@
+/*
+ * classgen.c - size class table for mm.c from allocation traces
+ *
+ * Reads .rep traces, in the format mdriver runs, and searches for the
+ * upper bounds of the size classes SIZE11 to SIZE15 that give the best
+ * utilization. The classes below SIZE11 hold a single size each and the
+ * bound of SIZE15, where SIZEN starts, is set with -m, so these stay as
+ * they are.
+ *
+ * A table is scored by replaying the traces through mm.c, built with
+ * -DCLASS_SEARCH so the table can be changed between runs, and taking the
+ * mean utilization over the traces the way mdriver does. The search moves
+ * one bound at a time to the size seen in the traces that scores best,
+ * until no move helps, starting from the table in mm.c.
+ *
+ * The table is written to a header mm.c is built against with
+ * -DCLASS_TABLE=\"classes.h\", see the mdriver.tuned target. For the
+ * table in mm.c and the new one, the allocations, their mean lifetime in
+ * trace operations and the internal fragmentation of each class are
+ * printed, the bytes of the blocks handed out beyond what was asked for.
+ *
+ * usage: classgen [-m top] [-o header] trace...
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define CLASSES 5           /* SIZE11 to SIZE15 */
+#define SMALL 56            /* largest block of the single size classes */
+#define MAXTOP 65536
+
+typedef struct {
+    char type;
+    int id;
+    size_t size;
+} op_t;
+
+typedef struct {
+    const char *name;
+    int ids, num_ops;
+    op_t *ops;
+} trace_t;
+
+/* what one replay of all traces saw in each class, SIZEN last */
+typedef struct {
+    double util;            /* mean over the traces */
+    unsigned long allocs[CLASSES + 1];
+    double life[CLASSES + 1];
+    double asked[CLASSES + 1], given[CLASSES + 1];
+} score_t;
+
+static trace_t *traces;
+static int num_traces;
+static size_t top = 1000;
+
+//the table mm.c was built with
+static size_t mm_bounds[CLASSES];
+
+/* the table mm.c uses, in a -DCLASS_SEARCH build */
+extern size_t mm_class_max[CLASSES];
+
+//the payload mm.c gives a request of size bytes, see adjust_size
+static size_t adjust_size(size_t size) {
+    size = (size + 3) & ~7;
+    return size < 8 ? 8 : size;
+}
+
+//index of bounds of the class size is in, CLASSES for SIZEN, -1 below
+static int class_of(const size_t *bounds, size_t size) {
+    int c;
+    if (size <= SMALL)
+        return -1;
+    for (c = 0; c < CLASSES; c++)
+        if (size <= bounds[c])
+            return c;
+    return CLASSES;
+}
+
+/* Replays every trace with the table in mm_class_max and adds up what
+ * each class saw */
+static void replay(score_t *sc) {
+    size_t *asked, live, peak, s;
+    void **ptrs, *p;
+    long *born;
+    int t, i, c;
+    memset(sc, 0, sizeof(*sc));
+    for (t = 0; t < num_traces; t++) {
+        trace_t *tr = &traces[t];
+        ptrs = calloc(tr->ids + 1, sizeof(void *));
+        asked = calloc(tr->ids + 1, sizeof(size_t));
+        born = calloc(tr->ids + 1, sizeof(long));
+        mem_reset_brk();
+        if (ptrs == NULL || asked == NULL || born == NULL || mm_init() < 0) {
+            fprintf(stderr, "classgen: out of memory\n");
+            exit(1);
+        }
+        live = peak = 0;
+        for (i = 0; i < tr->num_ops; i++) {
+            op_t *op = &tr->ops[i];
+            if (op->type != 'a' && ptrs[op->id]) {
+                c = class_of(mm_class_max, adjust_size(asked[op->id]));
+                if (c >= 0)
+                    sc->life[c] += i - born[op->id];
+                live -= asked[op->id];
+            }
+            if (op->type == 'f') {
+                mm_free(ptrs[op->id]);
+                ptrs[op->id] = NULL;
+                continue;
+            }
+            if (op->type == 'a')
+                p = mm_malloc(op->size);
+            else
+                p = mm_realloc(ptrs[op->id], op->size);
+            if (p == NULL) {
+                fprintf(stderr, "classgen: %s ran out of memory\n", tr->name);
+                exit(1);
+            }
+            s = adjust_size(op->size);
+            if ((c = class_of(mm_class_max, s)) >= 0) {
+                sc->allocs[c]++;
+                sc->asked[c] += op->size;
+                sc->given[c] += mm_usable_size(p);
+            }
+            ptrs[op->id] = p;
+            asked[op->id] = op->size;
+            born[op->id] = i;
+            live += op->size;
+            if (live > peak)
+                peak = live;
+        }
+        for (i = 0; i < tr->ids; i++)
+            if (ptrs[i] && (c = class_of(mm_class_max, adjust_size(asked[i]))) >= 0)
+                sc->life[c] += tr->num_ops - born[i];
+        sc->util += mem_heapsize() ? (double)peak / mem_heapsize() : 1;
+        free(ptrs);
+        free(asked);
+        free(born);
+    }
+    sc->util /= num_traces;
+}
+
+/* Reads the trace at path into tr. Returns -1 if it can not be read. */
+static int read_trace(const char *path, trace_t *tr) {
+    FILE *f;
+    int weight, ranges, n = 0, id, size;
+    char type[2];
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+    if (fscanf(f, "%d %d %d %d", &weight, &tr->ids, &tr->num_ops, &ranges) != 4 ||
+            tr->ids < 0 || tr->num_ops < 0 ||
+            (tr->ops = calloc(tr->num_ops + 1, sizeof(op_t))) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    while (n < tr->num_ops && fscanf(f, "%1s %d", type, &id) == 2) {
+        if (id < 0 || id >= tr->ids)
+            break;
+        size = 0;
+        if (type[0] != 'f' && fscanf(f, "%d", &size) != 1)
+            break;
+        tr->ops[n].type = type[0];
+        tr->ops[n].id = id;
+        tr->ops[n].size = size;
+        n++;
+    }
+    tr->num_ops = n;
+    tr->name = path;
+    fclose(f);
+    return 0;
+}
+
+/* Moves one bound of mm_class_max at a time to the candidate size that scores best and
+ * repeats until nothing improves. Returns the score of bounds. */
+static double search(const size_t *cand, int ncand) {
+    size_t *bounds = mm_class_max, keep;
+    score_t sc;
+    double best, u;
+    int c, k, moved = 1;
+    replay(&sc);
+    best = sc.util;
+    while (moved) {
+        moved = 0;
+        for (c = 0; c < CLASSES - 1; c++) {
+            keep = bounds[c];
+            for (k = 0; k < ncand; k++) {
+                if (cand[k] <= (c ? bounds[c - 1] : SMALL) || cand[k] >= bounds[c + 1] ||
+                        cand[k] == keep)
+                    continue;
+                bounds[c] = cand[k];
+                replay(&sc);
+                if ((u = sc.util) > best + 1e-9) {
+                    best = u;
+                    keep = cand[k];
+                    moved = 1;
+                }
+            }
+            bounds[c] = keep;
+        }
+    }
+    return best;
+}
+
+/* Prints the utilization with bounds and, for each class, the
+ * allocations, their mean lifetime in trace operations and the internal
+ * fragmentation.
+ */
+static void report(const char *name, const size_t *bounds) {
+    score_t sc;
+    size_t lo = SMALL;
+    int c;
+    memcpy(mm_class_max, bounds, sizeof(mm_bounds));
+    replay(&sc);
+    printf("\n%s, utilization %.1f%%\n%-6s %6s %6s %10s %10s %7s\n",
+           name, 100 * sc.util, "class", "from", "to", "allocs", "lifetime",
+           "frag");
+    for (c = 0; c <= CLASSES; lo = bounds[c++]) {
+        if (c < CLASSES)
+            printf("SIZE%-2d %6zu %6zu", c + 11, lo + 8, bounds[c]);
+        else
+            printf("%-6s %6zu %6s", "SIZEN", lo + 8, "");
+        printf(" %10lu %10.0f %6.1f%%\n", sc.allocs[c],
+               sc.allocs[c] ? sc.life[c] / sc.allocs[c] : 0,
+               sc.asked[c] ? 100 * (sc.given[c] - sc.asked[c]) / sc.asked[c] : 0);
+    }
+}
+
+static int compare(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    const char *out = "classes.h";
+    size_t bounds[CLASSES], *cand;
+    memcpy(mm_bounds, mm_class_max, sizeof(mm_bounds));
+    int c, i, k, ncand = 0, total = 0;
+    FILE *f;
+    while ((c = getopt(argc, argv, "m:o:")) != -1) {
+        switch (c) {
+        case 'm':
+            top = strtoul(optarg, NULL, 0) & ~7;
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+    if (optind >= argc || top < SMALL + 8 * CLASSES || top > MAXTOP) {
+        fprintf(stderr, "usage: classgen [-m top] [-o header] trace...\n");
+        fprintf(stderr, "\t-m <top>   Largest block below SIZEN (default 1000).\n");
+        fprintf(stderr, "\t-o <file>  Header to write (default classes.h).\n");
+        return 1;
+    }
+    num_traces = argc - optind;
+    if ((traces = calloc(num_traces, sizeof(trace_t))) == NULL)
+        return 1;
+    for (i = 0; i < num_traces; i++) {
+        if (read_trace(argv[optind + i], &traces[i]) < 0) {
+            fprintf(stderr, "classgen: can not read %s\n", argv[optind + i]);
+            return 1;
+        }
+        total += traces[i].num_ops;
+    }
+
+    //the sizes asked for between SMALL and top are the candidate bounds
+    if ((cand = malloc((total + 1) * sizeof(size_t))) == NULL)
+        return 1;
+    for (i = 0; i < num_traces; i++)
+        for (k = 0; k < traces[i].num_ops; k++) {
+            size_t s = adjust_size(traces[i].ops[k].size);
+            if (traces[i].ops[k].type != 'f' && s > SMALL && s < top)
+                cand[ncand++] = s;
+        }
+    qsort(cand, ncand, sizeof(size_t), compare);
+    for (i = k = 0; i < ncand; i++)
+        if (k == 0 || cand[i] != cand[k - 1])
+            cand[k++] = cand[i];
+    ncand = k;
+
+    //start from the table in mm.c, squeezed under top if need be
+    for (c = CLASSES - 1; c >= 0; c--) {
+        bounds[c] = c == CLASSES - 1 ? top : mm_bounds[c];
+        if (c < CLASSES - 1 && bounds[c] >= bounds[c + 1])
+            bounds[c] = bounds[c + 1] - 8;
+    }
+    mem_init();
+    memcpy(mm_class_max, bounds, sizeof(bounds));
+    search(cand, ncand);
+    memcpy(bounds, mm_class_max, sizeof(bounds));
+
+    printf("%d operations in %d traces, %d sizes between %d and %zu bytes\n",
+           total, num_traces, ncand, SMALL, top);
+    report("mm.c", mm_bounds);
+    report(out, bounds);
+
+    if ((f = fopen(out, "w")) == NULL) {
+        fprintf(stderr, "classgen: can not write %s\n", out);
+        return 1;
+    }
+    fprintf(f, "/* Size classes generated by classgen from %d traces */\n",
+            num_traces);
+    for (c = 0; c < CLASSES; c++)
+        fprintf(f, "#define CLASS%d_MAX %zu\n", c + 11, bounds[c]);
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * colorbench.c - cache misses of objects that start at the same page offset
+ *
+ * Allocates many objects of one size, as page sized heap blocks and from a
+ * pool of page sized objects, and times walks that touch the first word
+ * of each. Without cache coloring the first lines of all of them fall in
+ * the same cache sets, so the walk misses even though they would all fit
+ * in L1. Built against mm.c with -DCACHE_COLORS=8 as colorbench.color.
+ *
+ * The miss counts come from perf_event_open: L1 data cache read misses
+ * and last level cache read misses, since there is no generic event for
+ * L2. They read as "-" where the kernel does not allow counting.
+ *
+ * usage: colorbench [objects [walks]]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "ftimer.h"
+
+#define OBJS 64
+#define WALKS 100000
+#define MAXOBJS 4096
+/* a heap block of this payload takes up exactly a page */
+#define PAGE_BLOCK 4092
+#define POOL_OBJ 4096
+
+static long *objs[MAXOBJS];
+static int nobjs = OBJS, walks = WALKS;
+
+static void walk(void *arg) {
+    int w, i;
+    (void)arg;
+    for (w = 0; w < walks; w++)
+        for (i = 0; i < nobjs; i++)
+            objs[i][0]++;
+}
+
+//opens a counter of cache event config for this thread, -1 if not allowed
+static int counter(uint64_t config) {
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HW_CACHE;
+    pe.size = sizeof(pe);
+    pe.config = config | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static void start(int fd) {
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+//prints the count of fd divided by per
+static void stop(int fd, double per) {
+    long long n;
+    if (fd >= 0)
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (fd < 0 || read(fd, &n, sizeof(n)) != sizeof(n))
+        printf(" %9s", "-");
+    else
+        printf(" %9.3f", n / per);
+}
+
+/* Times the walk over objs and prints the ns, L1 and last level misses
+ * per object touched */
+static void run(const char *name, int l1, int ll) {
+    double touches = (double)nobjs * walks, ns;
+    walk(NULL); /* warm up */
+    start(l1);
+    start(ll);
+    ns = ftimer_gettod(walk, NULL, 1) * 1e9 / touches;
+    printf("%-8s %9.2f", name, ns);
+    stop(l1, touches);
+    stop(ll, touches);
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    mm_pool *pool;
+    int i, l1, ll;
+    if (argc > 1)
+        nobjs = atoi(argv[1]);
+    if (argc > 2)
+        walks = atoi(argv[2]);
+    if (nobjs < 1 || nobjs > MAXOBJS || walks < 1) {
+        fprintf(stderr, "usage: colorbench [objects [walks]]\n");
+        return 1;
+    }
+    l1 = counter(PERF_COUNT_HW_CACHE_L1D);
+    ll = counter(PERF_COUNT_HW_CACHE_LL);
+    mem_init();
+    if (mm_init() < 0)
+        return 1;
+    printf("%d objects, per object touched\n", nobjs);
+    printf("%-8s %9s %9s %9s\n", "", "ns", "L1 miss", "LLC miss");
+
+    for (i = 0; i < nobjs; i++)
+        if ((objs[i] = mm_malloc(PAGE_BLOCK)) == NULL)
+            return 1;
+    run("heap", l1, ll);
+    for (i = 0; i < nobjs; i++)
+        mm_free(objs[i]);
+
+    pool = mm_pool_create(POOL_OBJ, 8);
+    for (i = 0; i < nobjs; i++)
+        if ((objs[i] = mm_pool_get(pool)) == NULL)
+            return 1;
+    run("pool", l1, ll);
+    mm_pool_destroy(pool);
+    mem_deinit();
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * handletest.c - tests the movable allocations and compaction of mm.c
+ *
+ * Allocates enough handles that the handle table grows several times,
+ * frees every other one and pins a few of the rest, then compacts in
+ * small steps. Each step has to leave the heap sound, the data of every
+ * handle intact and the pinned handles where they were. Compaction has
+ * to move blocks and give the freed tail of the heap back, and once the
+ * handles are unpinned it has to be able to move them too. Exits with 1
+ * at the first failure.
+ *
+ * usage: handletest [handles]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define PIN_EVERY 16
+#define BUDGET 4096
+
+static int handles = 5000;
+static unsigned int *h;
+static void **pinned, **addr;
+
+static size_t size_of(int i) {
+    return 1 + (i * 131) % 700;
+}
+
+static unsigned char fill_byte(int i) {
+    return (i * 7 + 3) & 0xff;
+}
+
+static int fail(const char *what) {
+    fprintf(stderr, "handletest: %s\n", what);
+    return 1;
+}
+
+//returns -1 unless every live handle holds its data
+static int check_data(void) {
+    unsigned char *p;
+    size_t j;
+    int i;
+    for (i = 1; i < handles; i += 2) {
+        p = mm_hderef(h[i]);
+        for (j = 0; j < size_of(i); j++)
+            if (p[j] != fill_byte(i))
+                return -1;
+    }
+    return 0;
+}
+
+//counts the live handles that moved since addr was taken, and takes it
+static int count_moved(int only_pinned) {
+    void *p;
+    int i, moved = 0;
+    for (i = 1; i < handles; i += 2) {
+        p = mm_hderef(h[i]);
+        if (!only_pinned || (i - 1) % (2 * PIN_EVERY) == 0)
+            moved += p != addr[i];
+        addr[i] = p;
+    }
+    return moved;
+}
+
+//compacts until nothing moves, returns the number of steps or -1
+static int compact(void) {
+    int i, steps = 0;
+    while (mm_compact(BUDGET) > 0) {
+        steps++;
+        if (mm_checkheap(0) || check_data() < 0)
+            return -1;
+        for (i = 1; i < handles; i += 2)
+            if (pinned[i] && mm_hderef(h[i]) != pinned[i])
+                return -1;
+    }
+    return steps;
+}
+
+int main(int argc, char **argv) {
+    size_t before, after;
+    int i, steps, moved;
+    if (argc > 1)
+        handles = atoi(argv[1]);
+    h = calloc(handles, sizeof(*h));
+    pinned = calloc(handles, sizeof(*pinned));
+    addr = calloc(handles, sizeof(*addr));
+    mem_init();
+    mm_init();
+
+    for (i = 0; i < handles; i++) {
+        if ((h[i] = mm_halloc(size_of(i))) == 0)
+            return fail("mm_halloc failed");
+        memset(mm_hderef(h[i]), fill_byte(i), size_of(i));
+    }
+    for (i = 0; i < handles; i += 2)
+        mm_hfree(h[i]);
+    for (i = 1; i < handles; i += 2 * PIN_EVERY)
+        pinned[i] = mm_hpin(h[i]);
+    if (mm_checkheap(0) || check_data() < 0)
+        return fail("handles damaged before compaction");
+    count_moved(0);
+
+    before = mem_heapsize();
+    if ((steps = compact()) < 0)
+        return fail("compaction damaged the heap or moved a pinned handle");
+    after = mem_heapsize();
+    moved = count_moved(0);
+    if (moved == 0 || after >= before)
+        return fail("compaction moved nothing or did not trim the heap");
+    printf("%d steps moved %d of %d handles, heap %zu -> %zu bytes\n",
+           steps, moved, handles / 2, before, after);
+
+    for (i = 1; i < handles; i += 2 * PIN_EVERY) {
+        mm_hunpin(h[i]);
+        pinned[i] = NULL;
+    }
+    if (compact() < 0)
+        return fail("compaction damaged the heap");
+    if ((moved = count_moved(1)) == 0)
+        return fail("unpinned handles did not move");
+    printf("after unpinning, %d handles moved, heap %zu bytes\n",
+           moved, mem_heapsize());
+
+    for (i = 1; i < handles; i += 2)
+        mm_hfree(h[i]);
+    if (mm_checkheap(0))
+        return fail("heap corrupt after freeing the handles");
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * mainttest.c - tests that mm_maint_step drains the quicklists of idle
+ * threads of mm.c without taking blocks from busy ones
+ *
+ * A thread fills its quicklist and goes idle, two maintenance steps have
+ * to drain the list back into the heap. Then four threads allocate from
+ * their quicklists and check their blocks while the maintenance thread
+ * runs a step every millisecond. No block may change under the thread
+ * that holds it, and once the threads are done and the lists flushed,
+ * every block allocated has to be freed and the heap sound. Exits with 1
+ * at the first failure.
+ *
+ * usage: mainttest [rounds per thread]
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define THREADS 4
+#define BATCH 100
+#define IDLE_BLOCKS 40
+
+static volatile int stop;
+static long rounds = 100000;
+
+//fills its quicklist, then waits without touching it again
+static void *idle(void *arg) {
+    void *p[IDLE_BLOCKS];
+    int i;
+    for (i = 0; i < IDLE_BLOCKS; i++)
+        p[i] = mm_malloc_fast(32);
+    for (i = 0; i < IDLE_BLOCKS; i++)
+        mm_free_sized(p[i], 32);
+    while (!stop)
+        usleep(1000);
+    return arg;
+}
+
+//returns 1 if a block changed while the thread held it
+static void *busy(void *arg) {
+    long *p[BATCH], r, bad = 0;
+    unsigned int seed = (unsigned int)(long)arg;
+    int i;
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < BATCH; i++) {
+            p[i] = rand_r(&seed) & 1 ? mm_malloc_fast(16) : mm_malloc_fast(48);
+            p[i][0] = (long)p[i] ^ r;
+            p[i][1] = i;
+        }
+        for (i = 0; i < BATCH; i++) {
+            bad |= p[i][0] != ((long)p[i] ^ r) || p[i][1] != i;
+            if (mm_usable_size(p[i]) >= 48)
+                mm_free_sized(p[i], 48);
+            else
+                mm_free_sized(p[i], 16);
+        }
+        if (r % 1000 == 0)
+            usleep(50);
+    }
+    return (void *)bad;
+}
+
+//returns 0 if every block allocated has been freed
+static int balanced(void) {
+    struct mm_stats hs;
+    size_t allocs = 0, frees = 0;
+    int i;
+    mm_get_stats(&hs);
+    for (i = 0; i < MM_CLASSES; i++) {
+        allocs += hs.classes[i].allocs;
+        frees += hs.classes[i].frees;
+    }
+    return allocs == frees ? 0 : -1;
+}
+
+static int fail(const char *what) {
+    fprintf(stderr, "mainttest: %s\n", what);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    struct mm_maint_config conf = {1, 1 << 20, 64 << 10, 1 << 20};
+    struct mm_maint_stats st;
+    pthread_t t[THREADS];
+    void *bad;
+    long i;
+    if (argc > 1)
+        rounds = atol(argv[1]);
+    mem_init();
+    mm_init();
+    //the first start turns locking on, steps are run by hand until the next
+    if (mm_maint_start(&conf) < 0)
+        return fail("mm_maint_start failed");
+    mm_maint_stop();
+
+    pthread_create(&t[0], NULL, idle, NULL);
+    usleep(20000);
+    mm_maint_step();
+    mm_maint_step();
+    mm_maint_stats(&st);
+    if (st.drained < IDLE_BLOCKS || balanced() < 0)
+        return fail("the idle thread's quicklist was not drained");
+    printf("drained %zu blocks of an idle thread\n", st.drained);
+    stop = 1;
+    pthread_join(t[0], NULL);
+
+    if (mm_maint_start(&conf) < 0)
+        return fail("mm_maint_start failed");
+    for (i = 0; i < THREADS; i++)
+        pthread_create(&t[i], NULL, busy, (void *)(i + 1));
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(t[i], &bad);
+        if (bad)
+            return fail("a block changed while its thread held it");
+    }
+    mm_maint_stop();
+    mm_quick_flush();
+    mm_maint_stats(&st);
+    if (balanced() < 0 || mm_checkheap(0))
+        return fail("blocks lost or heap corrupt after the busy threads");
+    printf("%zu steps drained %zu blocks from %d busy threads\n",
+           st.steps, st.drained, THREADS);
+    return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * mapbench.cpp - std::map and std::unordered_map throughput with
+ * different allocators
+ *
+ * Inserts N keys in random order, then erases them in another random
+ * order, and reports ns per insert/erase pair. The std column uses
+ * std::allocator, so it measures the system allocator in mapbench and
+ * mm.c in mapbench.mm, which links mmnew.o.
+ *
+ * usage: mapbench [keys] [rounds]
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory_resource>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "mm.hpp"
+
+static std::vector<int> ins, del;
+static int rounds = 10;
+
+template <class Map, class Release>
+static double run(Map &map, Release release) {
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (int k : ins)
+            map.emplace(k, k);
+        for (int k : del)
+            map.erase(k);
+        release();
+    }
+    std::chrono::duration<double, std::nano> ns = std::chrono::steady_clock::now() - start;
+    return ns.count() / ((double)rounds * ins.size());
+}
+
+template <template <class...> class Map, class... Hash>
+static void bench(const char *name) {
+    typedef std::pair<const int, int> value;
+    typedef Map<int, int, Hash..., std::pmr::polymorphic_allocator<value>> pmr_map;
+    auto none = [] {};
+    double std_ns, mm_ns, pool_ns, arena_ns;
+    {
+        Map<int, int, Hash...> map;
+        std_ns = run(map, none);
+    }
+    {
+        Map<int, int, Hash..., mm::allocator<value>> map;
+        mm_ns = run(map, none);
+    }
+    {
+        mm::pool_resource pool;
+        std::pmr::polymorphic_allocator<value> alloc(&pool);
+        pmr_map map(alloc);
+        pool_ns = run(map, none);
+    }
+    {
+        mm::arena_resource arena;
+        std::pmr::polymorphic_allocator<value> alloc(&arena);
+        pmr_map map(alloc);
+        /* erasing frees nothing, drop the map and the arena every round */
+        arena_ns = run(map, [&] {
+            map.~pmr_map();
+            arena.release();
+            new (&map) pmr_map(alloc);
+        });
+    }
+    std::printf("%-14s %8.1f %8.1f %8.1f %8.1f\n", name, std_ns, mm_ns, pool_ns, arena_ns);
+}
+
+int main(int argc, char **argv) {
+    int keys = argc > 1 ? std::atoi(argv[1]) : 100000;
+    if (argc > 2)
+        rounds = std::atoi(argv[2]);
+    std::mt19937 rng(15213);
+    for (int i = 0; i < keys; i++)
+        ins.push_back(i);
+    std::shuffle(ins.begin(), ins.end(), rng);
+    del = ins;
+    std::shuffle(del.begin(), del.end(), rng);
+
+    mm::init();
+    std::printf("ns/op          %8s %8s %8s %8s\n", "std", "mm", "pool", "arena");
+    bench<std::map, std::less<int>>("map");
+    bench<std::unordered_map, std::hash<int>, std::equal_to<int>>("unordered_map");
+    return 0;
+}
@@ -25,6 +25,7 @@
 
 #include "mm.h"
 #include "memlib.h"
+#include "mmcopy.h"
 #include "fsecs.h"
 #include "config.h"
 
@@ -36,10 +37,18 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define SHORT_LIVED_OPS 256 /* blocks freed within this many ops are short lived */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
+/* Returns true if a payload of size bytes at p crosses a page boundary
+ * it could have fit between */
+#define PAGE_BYTES 4096
+#define STRADDLES(p, size) ((size) > 0 && (size) <= PAGE_BYTES && \
+    ((unsigned long)(p) / PAGE_BYTES) != \
+    (((unsigned long)(p) + (size) - 1) / PAGE_BYTES))
+
 /* weights */
 #define WNONE 0
 #define WALL 1
@@ -109,6 +118,22 @@ typedef struct {
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
 
+    /* most live blocks of at most a page straddling a page boundary */
+    int straddle;
+
+    /* fraction of mm_predict_lifetime guesses that matched the trace */
+    double pred;
+
+    /* bytes realloc and compaction copied between blocks */
+    size_t copied;
+
+    /* KB of new heap malloc faulted in while checking the trace for
+       correctness, see the faulted count of mm_get_stats */
+    size_t faulted;
+
+    /* secs for the trace with guard page sampling on (set by -G) */
+    double guard_secs;
+
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
@@ -140,6 +165,18 @@ int onetime_flag = 0;
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* if set, time the traces again sampling one in this many allocations
+   into guard pages (set by -G) */
+static unsigned int guard_rate = 0;
+
+/* how much of the heap mm.c checks as it goes, -1 for its default
+   (set by -k) */
+static int check_level = -1;
+
+/* if set, print mm.c's counters after each trace's correctness run
+   (set by -S) */
+static int print_stats = 0;
+
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -173,17 +210,19 @@ static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
-static int eval_libc_valid(trace_t *trace);
+static int eval_libc_valid(trace_t *trace, int *straddle);
 static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, int *straddle,
+                           double *pred, size_t *copied);
 static void eval_mm_speed(void *ptr);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printstats(const char *filename);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -208,6 +247,7 @@ static void run_tests(int num_tracefiles, const char *tracedir,
                       stats_t *mm_stats, range_t *ranges, speed_t *speed_params) {
     volatile int i;
     volatile int timed_out = 0;
+    struct mm_stats heap;
 
     for (i=0; i < num_tracefiles; i++) {
         /* initialize simulated memory system in memlib.c *
@@ -229,6 +269,10 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             if (verbose > 1)
                 printf("Checking mm_malloc for correctness, ");
             mm_stats[i].valid = eval_mm_valid(trace, &ranges);
+            mm_get_stats(&heap);
+            mm_stats[i].faulted = heap.faulted >> 10;
+            if (print_stats)
+                printstats(trace->filename);
 
             if (onetime_flag) {
                 free_trace(trace);
@@ -238,12 +282,20 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         if (mm_stats[i].valid) {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i].straddle,
+                                            &mm_stats[i].pred,
+                                            &mm_stats[i].copied);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+            if (guard_rate) {
+                if (mm_guard_start(guard_rate, 0) < 0)
+                    unix_error("mm_guard_start failed in run_tests");
+                mm_stats[i].guard_secs = fsecs(eval_mm_speed, speed_params);
+                mm_guard_start(0, 0);
+            }
         }
 
         free_trace(trace);
@@ -275,6 +327,8 @@ int main(int argc, char **argv)
     speed_t speed_params;      /* input parameters to the xx_speed routines */
 
     int run_libc = 0;     /* If set, run libc malloc (set by -l) */
+    size_t prefault = 0;  /* bytes mem_sbrk keeps faulted in (set by -P) */
+    int mlock_heap = 0;   /* if set, lock the heap in memory (set by -M) */
     int autograder = 0;   /* if set then called by autograder (-A) */
 
     /* temporaries used to compute the performance index */
@@ -289,7 +343,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlD")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlDP:MG:k:S")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -347,6 +401,26 @@ int main(int argc, char **argv)
             set_timeout = atoi(optarg);
             break;
 
+        case 'P': /* Keep <KB> above the brk faulted in */
+            prefault = (size_t)atol(optarg) << 10;
+            break;
+
+        case 'M': /* Lock the heap in memory */
+            mlock_heap = 1;
+            break;
+
+        case 'G': /* Time the traces again with guard page sampling */
+            guard_rate = atoi(optarg);
+            break;
+
+        case 'k': /* Set the heap check level of mm.c */
+            check_level = atoi(optarg);
+            break;
+
+        case 'S': /* Print mm.c's counters for each trace */
+            print_stats = 1;
+            break;
+
         case 'h': /* Print this message */
             usage();
             exit(0);
@@ -394,7 +468,7 @@ int main(int argc, char **argv)
 
             if (verbose > 1)
                 printf("Checking libc malloc for correctness, ");
-            libc_stats[i].valid = eval_libc_valid(trace);
+            libc_stats[i].valid = eval_libc_valid(trace, &libc_stats[i].straddle);
             if (libc_stats[i].valid) {
                 speed_params.trace = trace;
                 if (verbose > 1)
@@ -422,6 +496,10 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
 
+    if ((prefault || mlock_heap) && mem_prefault(prefault, mlock_heap) < 0)
+        unix_error("mem_prefault failed in main");
+    if (check_level >= 0 && mm_set_check(check_level, 0, 0) < 0)
+        app_error("mm.c was built without heap checks, see -DHEAP_CHECK\n");
     run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
               ranges, &speed_params);
 
@@ -536,6 +614,19 @@ int main(int argc, char **argv)
                p2*100,
                perfindex);
 
+        if (guard_rate && perf_weight) {
+            double gsecs = 0;
+            struct mm_guard_stats gs;
+            for (i=0; i < num_tracefiles; i++)
+                if(mm_stats[i].weight == WALL || mm_stats[i].weight == WPERF)
+                    gsecs += mm_stats[i].guard_secs;
+            mm_guard_stats(&gs);
+            printf("Guard pages 1 in %u: %.0f Kops/sec, %+.1f%% time, "
+                   "%zu samples\n", guard_rate,
+                   gsecs == 0 ? 0 : ops/gsecs/1000.0,
+                   secs == 0 ? 0 : 100.0*(gsecs - secs)/secs, gs.samples);
+        }
+
     }
     else { /* There were errors */
         perfindex = 0.0;
@@ -992,23 +1083,42 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  *   is always the high water mark of the heap.
  *
  *   A higher number is better: 1 is optimal.
+ *
+ *   Also counts the most live blocks of at most a page whose payload
+ *   straddles a page boundary at any one time. Each of those costs two
+ *   TLB entries where one would have done.
+ *
+ *   And scores mm_predict_lifetime: before each malloc we ask for its
+ *   guess, and when the block is freed we check whether it lived fewer
+ *   than SHORT_LIVED_OPS operations. Blocks never freed are long lived.
+ *
+ *   And reports how many bytes the package copied, see mmcopy.h.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, int *straddle,
+                           double *pred, size_t *copied)
 {
     int i;
     int index;
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
+    int straddling = 0;
+    int predicted = 0, correct = 0;
+    int *born;
+    char *guess;
     char *p;
     char *newp, *oldp;
 
     reinit_trace(trace);
+    if ((born = calloc(trace->num_ids, sizeof(*born))) == NULL ||
+        (guess = calloc(trace->num_ids, sizeof(*guess))) == NULL)
+        unix_error("calloc failed in eval_mm_util");
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
     if (mm_init() < 0)
         app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
+    mm_bytes_copied = 0;
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
@@ -1016,6 +1126,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         case ALLOC: /* mm_alloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
+            guess[index] = mm_predict_lifetime(size);
+            born[index] = i;
 
             if ((p = mm_malloc(size)) == NULL) {
                 app_error("trace %d: mm_malloc failed in eval_mm_util",
@@ -1027,6 +1139,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             trace->block_sizes[index] = size;
 
             total_size += size;
+            straddling += STRADDLES(p, size);
             break;
 
         case REALLOC: /* mm_realloc */
@@ -1045,6 +1158,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             trace->block_sizes[index] = newsize;
 
             total_size += (newsize - oldsize);
+            straddling += STRADDLES(newp, newsize) - STRADDLES(oldp, oldsize);
             break;
 
         case FREE: /* mm_free */
@@ -1060,6 +1174,13 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             mm_free(p);
 
             total_size -= size;
+            straddling -= STRADDLES(p, size);
+            if(index >= 0 && guess[index]) {
+                predicted++;
+                correct += (i - born[index] < SHORT_LIVED_OPS) ==
+                    (guess[index] == MM_SHORT_LIVED);
+                guess[index] = 0;
+            }
             break;
 
         default:
@@ -1067,10 +1188,22 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                       tracenum);
         }
 
-        /* update the high-water mark */
+        /* update the high-water marks */
         max_total_size = (total_size > max_total_size) ?
             total_size : max_total_size;
+        *straddle = (straddling > *straddle) ? straddling : *straddle;
+    }
+
+    for (index = 0; index < trace->num_ids; index++) {
+        if(guess[index]) {
+            predicted++;
+            correct += guess[index] == MM_LONG_LIVED;
+        }
     }
+    *pred = predicted ? (double)correct / predicted : 0;
+    *copied = mm_bytes_copied;
+    free(born);
+    free(guess);
 
     printf(".");
 
@@ -1136,9 +1269,10 @@ static void eval_mm_speed(void *ptr)
  *    We'll be conservative and terminate if any libc malloc call fails.
  *
  */
-static int eval_libc_valid(trace_t *trace)
+static int eval_libc_valid(trace_t *trace, int *straddle)
 {
-    int i, newsize;
+    int i, index, newsize;
+    int straddling = 0;
     char *p, *newp, *oldp;
 
     reinit_trace(trace);
@@ -1151,22 +1285,32 @@ static int eval_libc_valid(trace_t *trace)
                 malloc_error(trace, i, "libc malloc failed");
                 unix_error("System message");
             }
-            trace->blocks[trace->ops[i].index] = p;
+            index = trace->ops[i].index;
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = trace->ops[i].size;
+            straddling += STRADDLES(p, trace->block_sizes[index]);
             break;
 
         case REALLOC: /* realloc */
+            index = trace->ops[i].index;
             newsize = trace->ops[i].size;
-            oldp = trace->blocks[trace->ops[i].index];
+            oldp = trace->blocks[index];
+            straddling -= STRADDLES(oldp, trace->block_sizes[index]);
             if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0) {
                 malloc_error(trace, i, "libc realloc failed");
                 unix_error("System message");
             }
-            trace->blocks[trace->ops[i].index] = newp;
+            straddling += STRADDLES(newp, newsize);
+            trace->blocks[index] = newp;
+            trace->block_sizes[index] = newsize;
             break;
 
         case FREE: /* free */
-            if(trace->ops[i].index >= 0) {
-                free(trace->blocks[trace->ops[i].index]);
+            index = trace->ops[i].index;
+            if(index >= 0) {
+                straddling -= STRADDLES(trace->blocks[index],
+                                        trace->block_sizes[index]);
+                free(trace->blocks[index]);
             } else {
                 free(0);
             }
@@ -1175,6 +1319,7 @@ static int eval_libc_valid(trace_t *trace)
         default:
             app_error("invalid operation type  in eval_libc_valid");
         }
+        *straddle = (straddling > *straddle) ? straddling : *straddle;
     }
 
     return 1;
@@ -1248,8 +1393,9 @@ static void printresults(int n, stats_t *stats)
     char wstr;
 
     /* Print the individual results for each trace */
-    printf("  %2s%6s %5s%8s%9s  %s\n",
-           "valid", "util", "ops", "secs", "Kops", "trace");
+    printf("  %2s%6s %5s%8s%9s%7s%6s%8s%7s  %s\n",
+           "valid", "util", "ops", "secs", "Kops", "strad", "pred", "copyKB",
+           "fltKB", "trace");
     for (i=0; i < n; i++) {
         if (stats[i].valid) {
             switch(stats[i].weight)
@@ -1291,6 +1437,10 @@ static void printresults(int n, stats_t *stats)
             else
                 printf("%8s%10s%6s", "--", "--", "--");
 
+            printf("%7d", stats[i].straddle);
+            printf(" %4.0f%%", stats[i].pred * 100.0);
+            printf("%8zu", stats[i].copied >> 10);
+            printf("%7zu", stats[i].faulted);
             printf(" %s\n", stats[i].filename);
 
             if(stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1306,13 +1456,17 @@ static void printresults(int n, stats_t *stats)
                 }
         }
         else {
-            printf("%2s%4s %6s%8s%10s%6s %s\n",
+            printf("%2s%4s %6s%8s%10s%6s%7s%6s%8s%7s %s\n",
                    stats[i].weight != 0 ? "*" : "",
                    "no",
                    "-",
                    "-",
                    "-",
                    "-",
+                   "-",
+                   "-",
+                   "-",
+                   "-",
                    stats[i].filename);
         }
     }
@@ -1339,6 +1493,32 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printstats - Print mm_get_stats by size class, after a trace ran
+ */
+static void printstats(const char *filename)
+{
+    struct mm_stats st;
+    struct mm_class_stats *c;
+    int i;
+
+    mm_get_stats(&st);
+    printf("\n%s: heap %zuKB, peak %zuKB, %lu grows, live %zuKB, peak %zuKB\n",
+           filename, st.heap_size >> 10, st.peak_heap >> 10, st.grows,
+           st.live_bytes >> 10, st.peak_live >> 10);
+    printf("%5s%9s%9s%9s%7s%8s%9s%9s%10s%8s\n", "class", "allocs", "frees",
+           "liveKB", "free", "freeKB", "splits", "merges", "steps", "fallbk");
+    for (i = 0; i < MM_CLASSES; i++) {
+        c = &st.classes[i];
+        if (c->allocs == 0 && c->free_blocks == 0)
+            continue;
+        printf("%5d%9lu%9lu%9zu%7zu%8zu%9lu%9lu%10lu%8lu\n", i, c->allocs,
+               c->frees, c->live_bytes >> 10, c->free_blocks,
+               c->free_bytes >> 10, c->splits, c->coalesces,
+               c->search_steps, c->fallbacks);
+    }
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1384,7 +1564,7 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-    fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+    fprintf(stderr, "Usage: mdriver [-hlVdDMS] [-f <file>] [-P <KB>] [-G <n>] [-k <i>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -1396,4 +1576,9 @@ static void usage(void)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-P <KB>    Fault in <KB> of heap ahead of the brk.\n");
+    fprintf(stderr, "\t-M         Lock the heap in memory.\n");
+    fprintf(stderr, "\t-G <n>     Also time with 1 in <n> allocations in guard pages.\n");
+    fprintf(stderr, "\t-k <i>     Heap checks in mm.c: 0 off; 1 local; 2 rolling; 3 full.\n");
+    fprintf(stderr, "\t-S         Print mm.c's counters after checking each trace.\n");
 }
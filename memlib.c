@@ -12,16 +12,46 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/* Outside the driver pages are made accessible this many bytes at a time */
+#define MEM_COMMIT (1 << 16)
+
+/* Address space kept inaccessible right above the heap, see mem_spare. It
+ * ends at most 4 GB past the start of the heap. */
+#define MEM_SPARE ((size_t)MAX_HEAP < (1UL << 32) - (1UL << 28) ? \
+		(size_t)1 << 28 : (1UL << 32) - (size_t)MAX_HEAP)
+
 /* private variables */
 static char *heap;
 static char *mem_brk;
 static char *mem_max_addr;
+static char *mem_mapped;			/* end of the accessible pages */
+static int mem_reserved;			/* pages follow the brk */
+static char mem_path[PATH_MAX];		/* file of a private heap, or "" */
+static char *mem_spare_lo;			/* see mem_spare */
+static size_t mem_spare_len;
+
+/*
+ * Pre-faulting, set by mem_prefault. The pages up to mem_ahead bytes above
+ * the brk are faulted in, and locked if mem_lock is set, before the heap
+ * grows into them. mem_populate does this ahead of time, mem_sbrk only
+ * does it itself once the brk passes mem_faulted. With mem_lock set
+ * mem_sbrk locks every page the heap grows into, even if mem_ahead is 0.
+ */
+static size_t mem_ahead;
+static int mem_lock;
+static char *mem_faulted;			/* end of the populated pages */
+static size_t mem_inline;			/* see mem_inline_faulted */
+
+static int mem_fault_to(char *end);
+static int mem_move_brk(char *new_brk);
 
+#ifdef DRIVER
 /*
  * mem_init - initialize the memory system model
  */
@@ -35,6 +65,126 @@ void mem_init(void){
 			0);						/* offset (dunno) */
 	mem_max_addr = heap + MAX_HEAP;
 	mem_brk = heap;					/* heap is empty initially */
+	mem_mapped = mem_max_addr;
+	mem_reserved = 0;
+	mem_faulted = heap;
+	mem_fault_to(heap + mem_ahead);
+	mem_spare_lo = mmap(mem_max_addr, MEM_SPARE, PROT_NONE, MAP_PRIVATE |
+			MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+	if (mem_spare_lo != mem_max_addr) {
+		/* taken, or a kernel that only took the address as a hint */
+		if (mem_spare_lo != MAP_FAILED)
+			munmap(mem_spare_lo, MEM_SPARE);
+		mem_spare_lo = NULL;
+	}
+	mem_spare_len = mem_spare_lo ? MEM_SPARE : 0;
+}
+#else
+/*
+ * mem_init - reserve MAX_HEAP bytes of address space for the heap, and the
+ *		spare space above it. Only the pages below the brk are accessible
+ *		and backed by memory.
+ */
+void mem_init(void){
+	heap = mmap(NULL, MAX_HEAP + MEM_SPARE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	mem_max_addr = heap + MAX_HEAP;
+	mem_spare_lo = mem_max_addr;
+	mem_spare_len = MEM_SPARE;
+	mem_brk = heap;
+	mem_mapped = heap;
+	mem_reserved = 1;
+	mem_faulted = heap;
+	if (mem_ahead && mem_move_brk(heap) == 0)
+		mem_fault_to(heap + mem_ahead);
+}
+#endif
+
+/*
+ * mem_init_file - like mem_init, but the heap is a mapping of the file at
+ *		path, which is created if needed. Whatever the file held is
+ *		visible below the heap's brk once it has been extended. If share
+ *		is set the mapping is shared, and if path is NULL it is anonymous
+ *		and only shared with children forked later. Otherwise it is
+ *		private, and the file only changes when mem_sync replaces it.
+ *		Returns -1 on error.
+ */
+int mem_init_file(const char *path, int share){
+	int fd = -1, flags = share ? MAP_SHARED : MAP_PRIVATE | MAP_NORESERVE;
+	if (path == NULL)
+		flags |= MAP_ANONYMOUS;
+	else if (strlen(path) >= sizeof(mem_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	} else if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+		return -1;
+	if (fd >= 0 && ftruncate(fd, MAX_HEAP) < 0) {
+		close(fd);
+		return -1;
+	}
+	heap = mmap((void *)0x800000000, MAX_HEAP, PROT_READ | PROT_WRITE,
+			flags, fd, 0);
+	if (fd >= 0)
+		close(fd);
+	if (heap == MAP_FAILED)
+		return -1;
+	strcpy(mem_path, share || path == NULL ? "" : path);
+	mem_spare_lo = NULL;
+	mem_spare_len = 0;
+	mem_max_addr = heap + MAX_HEAP;
+	mem_brk = heap;
+	mem_mapped = mem_max_addr;
+	mem_reserved = 0;
+	mem_faulted = heap;
+	return 0;
+}
+
+/*
+ * mem_sync - write a file backed heap back to its file. A private heap
+ *		is written to a new file that is then renamed over the old one,
+ *		so after a crash the file holds either the heap as of this call
+ *		or as of the one before. Returns -1 on error.
+ */
+int mem_sync(void){
+	char tmp[sizeof(mem_path) + sizeof(".sync")], *dir;
+	size_t done = 0, len = mem_brk - heap;
+	ssize_t n;
+	int fd, ok;
+	if (mem_path[0] == '\0')
+		return msync(heap, len, MS_SYNC);
+	snprintf(tmp, sizeof(tmp), "%s.sync", mem_path);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+		return -1;
+	while (done < len && (n = write(fd, heap + done, len - done)) > 0)
+		done += n;
+	ok = done == len && fsync(fd) == 0;
+	if (close(fd) < 0 || !ok || rename(tmp, mem_path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	/* the rename itself is only durable once the directory is synced */
+	strcpy(tmp, mem_path);
+	dir = strrchr(tmp, '/');
+	if (dir == tmp)
+		dir[1] = '\0';
+	else if (dir)
+		*dir = '\0';
+	if ((fd = open(dir ? tmp : ".", O_RDONLY | O_DIRECTORY)) < 0)
+		return -1;
+	ok = fsync(fd);
+	close(fd);
+	return ok;
+}
+
+/*
+ * mem_spare - the inaccessible address space memlib keeps right above the
+ *		heap of mem_init, for the caller to map as it likes. Sets *len to
+ *		its size, and returns NULL if there is none. An address in it is
+ *		less than 4 GB above mem_heap_lo.
+ */
+void *mem_spare(size_t *len){
+	*len = mem_spare_len;
+	return mem_spare_lo;
 }
 
 /*
@@ -42,6 +192,11 @@ void mem_init(void){
  */
 void mem_deinit(void){
 	munmap(heap, MAX_HEAP);
+	if (mem_spare_lo)
+		munmap(mem_spare_lo, mem_spare_len);
+	mem_spare_lo = NULL;
+	mem_spare_len = 0;
+	mem_path[0] = '\0';
 }
 
 /*
@@ -51,26 +206,150 @@ void mem_reset_brk(){
 	mem_brk = heap;
 }
 
+/*
+ * mem_move_brk - make the pages up to new_brk accessible, and give the
+ *		pages above it back to the OS if the heap was reserved by mem_init.
+ *		Returns -1 if the pages can not be had.
+ */
+static int mem_move_brk(char *new_brk){
+	char *top;
+#ifdef DRIVER
+    // call sbrk() in an attempt to have similar semantics as a real allocator.
+    // The real break is never lowered, libc's malloc may be using it.
+	if (new_brk > mem_brk && sbrk(new_brk - mem_brk) == (void *) -1)
+		return -1;
+#endif
+	if (!mem_reserved)
+		return 0;
+	new_brk += mem_ahead;
+	top = heap + (((new_brk - heap) + MEM_COMMIT - 1) & ~(MEM_COMMIT - 1));
+	if (top > mem_max_addr)
+		top = mem_max_addr;
+	if (top > mem_mapped) {
+		if (mprotect(mem_mapped, top - mem_mapped, PROT_READ | PROT_WRITE) < 0)
+			return -1;
+	} else if (top < mem_mapped) {
+		if (mem_lock)
+			munlock(top, mem_mapped - top);
+		madvise(top, mem_mapped - top, MADV_DONTNEED);
+		if (mem_faulted > top)
+			mem_faulted = top;
+		mprotect(top, mem_mapped - top, PROT_NONE);
+	}
+	mem_mapped = top;
+	return 0;
+}
+
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		by incr bytes and returns the start address of the new area. A
+ *		negative incr shrinks the heap, but never below its start.
  */
-void *mem_sbrk(int incr) {
+void *mem_sbrk(intptr_t incr) {
 	char *old_brk = mem_brk;
+	char *faulted = mem_faulted;
 
-    // call sbrk() in an attempt to have similar semantics as a real allocator.
-	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr) ||
-            sbrk(incr) == (void *) -1) {
+	if ( ((mem_brk + incr) < heap) || ((mem_brk + incr) > mem_max_addr) ||
+            mem_move_brk(mem_brk + incr) < 0) {
 		errno = ENOMEM;
+#ifdef DRIVER
 		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+#endif
 		return (void *)-1;
 	}
 
+	/* the window above the brk is only a hint, the pages below it have
+	 * to be locked */
+	if ((mem_ahead || mem_lock) && mem_brk + incr > mem_faulted &&
+	    mem_fault_to(mem_brk + incr + mem_ahead) < 0 &&
+	    mem_fault_to(mem_brk + incr) < 0) {
+		mem_move_brk(mem_brk);
+		errno = ENOMEM;
+#ifdef DRIVER
+		perror("ERROR: mem_sbrk failed to lock the heap");
+#endif
+		return (void *)-1;
+	}
+	if (mem_ahead || mem_lock)
+		mem_inline += mem_faulted - faulted;
+	else if (incr > 0)
+		mem_inline += incr;
 	mem_brk += incr;
 	return (void *)old_brk;
 }
 
+/*
+ * mem_fault_to - fault in, or lock, the pages from mem_faulted up to end.
+ *		Pages below the brk may be in use by other threads, touching them
+ *		has to leave their contents alone. Returns -1, with mem_faulted
+ *		left where it was, if the pages could not be locked.
+ */
+static int mem_fault_to(char *end){
+	size_t page = mem_pagesize();
+	char *p, *lo = mem_faulted;
+	end = heap + (((end - heap) + page - 1) & ~(page - 1));
+	if (end > mem_max_addr)
+		end = mem_max_addr;
+	if (mem_reserved && end > mem_mapped)
+		end = mem_mapped;
+	if (end <= lo)
+		return 0;
+	if (mem_lock) {
+		if (mlock(lo, end - lo) < 0)
+			return -1;
+	}
+#ifdef MADV_POPULATE_WRITE
+	else if (madvise(lo, end - lo, MADV_POPULATE_WRITE) == 0)
+		;
+#endif
+	else
+		for (p = lo; p < end; p += page)
+			__atomic_fetch_add((int *)p, 0, __ATOMIC_RELAXED);
+	mem_faulted = end;
+	return 0;
+}
+
+/*
+ * mem_prefault - keep the ahead bytes above the brk faulted in, and if
+ *		lock is set keep the whole heap locked in memory. Works on the
+ *		current heap and on those set up by later calls to mem_init.
+ *		Returns -1 if the pages could not be locked.
+ */
+int mem_prefault(size_t ahead, int lock){
+	char *top;
+	mem_ahead = ahead;
+	mem_lock = lock;
+	if (heap == NULL)
+		return 0;
+	if (mem_move_brk(mem_brk) < 0)
+		return -1;
+	top = mem_faulted > mem_brk ? mem_faulted : mem_brk;
+	if (lock && mlock(heap, top - heap) < 0) {
+		mem_lock = 0;
+		return -1;
+	}
+	return mem_fault_to(mem_brk + mem_ahead);
+}
+
+/*
+ * mem_populate - fault in the pages up to mem_ahead bytes above the brk
+ *		ahead of time, so mem_sbrk does not have to. Returns -1 if the
+ *		pages could not be locked.
+ */
+int mem_populate(void){
+	return mem_ahead ? mem_fault_to(mem_brk + mem_ahead) : 0;
+}
+
+/*
+ * mem_inline_faulted - bytes of heap the allocator faults in while it
+ *		extends the heap: with pre-faulting the bytes mem_sbrk had to
+ *		populate itself because the brk got past the pages populated
+ *		ahead of time, without it every byte the heap grew by
+ */
+size_t mem_inline_faulted(void){
+	return mem_inline;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
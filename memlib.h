@@ -1,11 +1,18 @@
 #include <unistd.h>
+#include <stdint.h>
 
 void mem_init(void);               
+int mem_init_file(const char *path, int share);
+int mem_sync(void);
+void *mem_spare(size_t *len);
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+int mem_prefault(size_t ahead, int lock);
+int mem_populate(void);
+size_t mem_inline_faulted(void);
 
@@ -4,31 +4,43 @@
  *
  * My implementation of malloc uses a segregated freelist
  * made up of circular linked lists. 
- * Heap blocks all have a header but not all have a footer.
+ * Heap blocks all have a header but only free blocks have a footer.
  * Headers and footers (when present) account for 4 bytes each.
- * By ommitting footers on smaller allocations overhead is reduced.
+ * By ommitting footers on allocated blocks overhead is reduced.
  * Another way overhead is reduced is by taking advantage of knowing
  * the heap is limited to 2^32 bytes for this assignment and storing
  * free list pointers in 4 bytes and combining them with an offset when
  * calculating addresses. For more information on this see the 
  * documnetation on the node struct.
  *
- * The information necessary for traversing backwards in the heap
- * for a block with no footer is stored in the header of the 
- * next block by using two bit-flags. For more information on how this is
- * managed see the documentation for block_prev()
+ * Whether the previous block is allocated is stored in the header of the
+ * next block using a bit-flag, so only free blocks need a footer to be
+ * found when traversing backwards in the heap. For more information on
+ * how this is managed see the documentation for block_prev()
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#if defined(SIZE_INDEX) && (defined(__AVX2__) || defined(__SSE2__))
+#include <immintrin.h>
+#endif
 #include "contracts.h"
 
 #include "mm.h"
 #include "memlib.h"
+#include "mmcopy.h"
+#include "mmguard.h"
 
 
 // Create aliases for driver tests
@@ -44,22 +56,47 @@
  *  Logging Functions
  *  -----------------
  *  - dbg_printf acts like printf, but will not be run in a release build.
- *  - checkheap acts like mm_checkheap, but prints the line it failed on and
- *    exits if it fails.
+ *  - checkheap checks the heap at the level set with mm_set_check, see
+ *    check_step, and checkblock checks block n and its neighbours from
+ *    MM_CHECK_LOCAL up. Both print the line they failed on and exit if
+ *    they fail. A release build leaves them out unless it is built with
+ *    -DHEAP_CHECK.
+ *  - check_forget tells the rolling check that block n is going away.
  */
 
 #ifndef NDEBUG
 #define dbg_printf(...) printf(__VA_ARGS__)
-#define checkheap(verbose) do {if (mm_checkheap(verbose)) {  \
+#define CHECK_DEFAULT MM_CHECK_ROLLING
+#ifndef HEAP_CHECK
+#define HEAP_CHECK
+#endif
+#else
+#define dbg_printf(...)
+#define CHECK_DEFAULT MM_CHECK_OFF
+#endif
+
+#ifdef HEAP_CHECK
+#define checkheap(verbose) do {if (check_level > MM_CHECK_LOCAL && check_step(verbose)) {  \
                              printf("Checkheap failed on line %d\n", __LINE__);\
                              exit(-1);  \
                         }}while(0)
+#define checkblock(n) do {if (check_level && check_block(n)) {  \
+                             printf("Checkblock failed on line %d\n", __LINE__);\
+                             exit(-1);  \
+                        }}while(0)
+#define check_forget(n) do {if ((n) == roll) roll = NULL;} while(0)
 #else
-#define dbg_printf(...)
 #define checkheap(...)
+#define checkblock(...)
+#define check_forget(...)
 #endif
 
+#ifndef LIMIT
 #define LIMIT (0x6400000)
+#endif
+#if LIMIT > 0xffffffff
+#error "offsets from the bottom of the heap must fit in 32 bits"
+#endif
 /* Struct declaration used for manipulating block headers
  * in an organised way. Head refers to the 4 header bytes
  * that precede all blocks in the heap. Prev and next are
@@ -89,19 +126,59 @@ static inline char block_free(const node*);
 static inline node* block_next(const node*);
 static inline void add(node*);
 static inline void delete(node*);
+#ifdef SIZE_INDEX
+static inline void index_insert(node*, int);
+static inline void index_delete(const node*, int, char);
+static node* index_search(int, size_t);
+static void index_rebuild(void);
+static int check_index(int);
+#endif
 static inline void* found(node*);
 static inline node* get_list(int);
 static inline node** get_list_addr(int);
 static inline char get_class(size_t);
 int check_flist(node*, char, int*);
 static inline node* next(const node*);
+static inline uint32_t heap_off(const void*);
 static inline void setnext(node*, node*);
 static inline node* prev(const node*);
 static inline void setprev(node*, node*);
 void *carve(node*, size_t, size_t);
+void *carve_high(node*, size_t, size_t);
+void *carve_at(node*, size_t, size_t, size_t);
+static inline size_t page_pad(const node*, size_t);
+static inline size_t next_color(unsigned int*);
+#if CACHE_COLORS
+static inline size_t color_pad(const node*);
+#endif
 void *relocate(void*, size_t, size_t);
-void *searchlist(node**, size_t);
-static inline char get_fixed_bucket_offset(const char);
+void *searchlist(node**, size_t, char);
+static void policy_reset(void);
+static void adapt(int, size_t, size_t, size_t, unsigned int, int);
+static inline void* take(node*, size_t, size_t, char);
+static void *place(size_t, int);
+static void *own_alloc(size_t);
+static void release(void*);
+static void *resize(void*, size_t);
+static unsigned int halloc(size_t);
+static int check_heap(int);
+#ifdef HEAP_CHECK
+static int check_step(int);
+static int check_block(const node*);
+#endif
+static inline void lock(void);
+static inline void unlock(void);
+static void sb_load(void);
+static void lock_recover(void);
+static void sb_store(void);
+static void stats_collect(struct mm_stats*);
+static void stats_store(void);
+#ifndef DRIVER
+static void boot(void);
+#endif
+static inline char prev_free(const node*);
+static inline void block_unmark(const node*);
+static inline size_t adjust_size(size_t);
 static inline size_t get_combined_size3(const node*, const node*, const node*);
 static inline size_t get_combined_size2(const node*, const node*);
 
@@ -110,12 +187,93 @@ static inline size_t get_combined_size2(const node*, const node*);
 #define DSIZE 8
 #define METAMASK 7
 #define LISTBOUND 13
+/* Adaptive search: each list from SIZE11 up has its own lookahead, the
+ * number of blocks searchlist looks at past the first one that fits for a
+ * smaller one, starting at LOOKAHEAD. 0 is first fit. Every ADAPT_WINDOW
+ * searches in a class the lookahead is doubled if it often ended the
+ * search and looking ahead saved at least 1/ADAPT_GAIN of the bytes asked
+ * for, and halved if it saved less than a quarter of that. A class at
+ * first fit tries a lookahead of 1 again when most of its blocks have to
+ * be split and there were often others to look at. The lookahead stays
+ * between LOOKAHEAD_MIN and a bound that grows by LOOKAHEAD for every
+ * ADAPT_HEAP bytes of heap up to LOOKAHEAD_MAX, so a bigger heap spends
+ * more time on utilization. The lists below SIZE11 hold blocks of a single
+ * size and take the first.
+ * With -DSIZE_INDEX the indexed lists always find the best fit instead.
+ */
 #define LOOKAHEAD 10
+#ifndef LOOKAHEAD_MIN
+#define LOOKAHEAD_MIN 0
+#endif
+#ifndef LOOKAHEAD_MAX
+#define LOOKAHEAD_MAX 80
+#endif
+#define ADAPT_WINDOW 256
+#define ADAPT_GAIN 32
+#define ADAPT_HEAP (1 << 20)
+/* Two ended placement: a split block gives requests of at most SPLIT_HIGH
+ * bytes from its high end and larger requests from its low end, so small
+ * blocks collect at the top of free chunks instead of pinning their middle.
+ * Off by default, build with e.g. -DSPLIT_HIGH=104 to enable.
+ */
+#ifndef SPLIT_HIGH
+#define SPLIT_HIGH 0
+#endif
+
+/* Page aware placement: when a medium block (classes SIZE11 through SIZE15)
+ * carved from the front of a free block would straddle a page boundary and
+ * moving it up to start on the boundary skips at most PAGE_SLACK bytes, the
+ * skipped bytes are left behind as a free block and the allocation starts
+ * on the new page. Off by default, build with e.g. -DPAGE_SLACK=256.
+ */
+#define PAGESIZE 4096
+#ifndef PAGE_SLACK
+#define PAGE_SLACK 0
+#endif
+
+/* Cache coloring: blocks of the same size that start at the same offset in
+ * a page have their first lines, usually the hottest ones, in the same
+ * cache sets, where they evict each other. With -DCACHE_COLORS=n every
+ * block of at least COLOR_MIN bytes taken from mem_sbrk, every pool slab
+ * and every arena chunk starts one CACHE_LINE further into a span of n
+ * lines than the one before it, wrapping around. A heap block skips bytes
+ * the way PAGE_SLACK does, slabs and chunks leave them unused. Off by
+ * default, colorbench measures the difference.
+ */
+#define CACHE_LINE 64
+#define COLOR_MIN 2048
+#ifndef CACHE_COLORS
+#define CACHE_COLORS 0
+#endif
+
+/* Lifetime hints: mm_malloc_hint() places short lived blocks at the high
+ * end of the free blocks they are carved from and long lived blocks at the
+ * low end, so transient buffers are carved from, and coalesce back into,
+ * the top of a free region while long lived blocks fill it from the bottom.
+ * MM_LIFETIME_AUTO predicts the lifetime: a block is expected to be short
+ * lived if a block of similar size (same power of two) was freed within the
+ * last LIFETIME_WINDOW calls to malloc and free. Building with
+ * -DLIFETIME_AUTO makes plain malloc use the prediction as well.
+ * NO_HINT leaves placement to SPLIT_HIGH.
+ */
+#define NO_HINT 3
+#define LIFETIME_WINDOW 64
+#define LIFETIME_BUCKETS 64
+#ifdef LIFETIME_AUTO
+#define DEFAULT_HINT MM_LIFETIME_AUTO
+#else
+#define DEFAULT_HINT NO_HINT
+#endif
+
+//calls to malloc and free between copies of the published statistics
+#define STATS_EVERY 1024
 
 //bitpacking macros
 #define ALLOC 1
-#define PFIXED 2
-#define SZCLASS 4
+#define PREV_ALLOC 2
+#define MOVABLE 4
+//on a free block, its inner pages were given back by mm_maint_step
+#define PURGED MOVABLE
 
 //free list and size class macros
 #define SIZEN 12
@@ -132,30 +290,147 @@ static inline size_t get_combined_size2(const node*, const node*);
 #define SIZE5 1
 #define SIZE4 0
 
+/* Largest payloads of the classes SIZE11 to SIZE15, SIZEN takes the rest.
+ * Build with -DCLASS_TABLE=\"classes.h\" to use a table classgen made from
+ * traces instead. classgen itself links a build with -DCLASS_SEARCH, where
+ * the table is a variable it sets between runs.
+ */
+#ifdef CLASS_TABLE
+#include CLASS_TABLE
+#else
+#define CLASS11_MAX 72
+#define CLASS12_MAX 104
+#define CLASS13_MAX 304
+#define CLASS14_MAX 504
+#define CLASS15_MAX 1000
+#endif
+#ifdef CLASS_SEARCH
+size_t mm_class_max[5] = {CLASS11_MAX, CLASS12_MAX, CLASS13_MAX, CLASS14_MAX,
+                          CLASS15_MAX};
+#undef CLASS11_MAX
+#undef CLASS12_MAX
+#undef CLASS13_MAX
+#undef CLASS14_MAX
+#undef CLASS15_MAX
+#define CLASS11_MAX mm_class_max[0]
+#define CLASS12_MAX mm_class_max[1]
+#define CLASS13_MAX mm_class_max[2]
+#define CLASS14_MAX mm_class_max[3]
+#define CLASS15_MAX mm_class_max[4]
+#endif
+
 //global free list declarations
-static node* flist4 = NULL;
-static node* flist5 = NULL;
-static node* flist6 = NULL;
-static node* flist7 = NULL;
-static node* flist8 = NULL;
-static node* flist9 = NULL;
-static node* flist10 = NULL;
-static node* flist11 = NULL;
-static node* flist12 = NULL;
-static node* flist13 = NULL;
-static node* flist14 = NULL;
-static node* flist15 = NULL;
-static node* flistn = NULL;
-
-/* lists is used to access free lists as if they were an array by taking advantage
- * of the lists being adjacent in the data segment. The order of the flists
- * can be shifted around by the compiler but as long as the lists are retrieved
- * the same way throughout the entire program it makes no difference.
- */
-static node** lists = &flist4;
+static node* flists[LISTBOUND];
+
+/* lists is used to access free lists by using a size class as an index.
+ * flists[SIZE4] holds 8 byte blocks, and so on up to flists[SIZEN] (flistn)
+ * which holds every block larger than CLASS15_MAX bytes.
+ */
+static node** lists = flists;
 static node* prolog; //beginning of the heap
 static node* epilog; //last 4 bytes of the heap
 
+//counts calls to malloc, free and realloc, used as a clock for lifetime
+//prediction and to tell whether the heap changed between compaction steps
+static unsigned long clock_ops;
+//clock_ops of the last free of a block in each power of two size bucket
+static unsigned long last_free[LIFETIME_BUCKETS];
+
+//color of the next block placed at the end of the heap, see CACHE_COLORS
+static unsigned int heap_color;
+
+//search policy of each class and what it saw since it was last adjusted
+static struct {
+    struct mm_class_policy p;
+    unsigned int window, cut, splits;
+    size_t wanted, saved;
+} policy[LISTBOUND];
+
+//what mm_get_stats reports, kept under the lock like everything else
+static struct mm_stats heap_stats;
+//where mm_stats_publish has it copied to, see Published Statistics
+static struct mm_stats_page* stats_page;
+
+/* The handle table maps handles to the offset from lbound of the block
+ * holding them. It is an ordinary allocated block, so it is never moved
+ * by compaction itself. Unused entries are chained through off starting
+ * at hfree and have pins set to HANDLE_FREE.
+ */
+struct handle {
+    uint32_t off;
+    uint32_t pins;
+};
+#define HANDLE_FREE 0xffffffff
+static struct handle* htable;
+static uint32_t hcap;
+static uint32_t hfree;
+//block compaction will look at next, if nothing changed in the heap
+static node* hcursor;
+static unsigned long hcursor_clock;
+//mm_maint_step will look at next on the large free list, the same way
+static node* pcursor;
+static unsigned long pcursor_clock;
+
+//see mm_set_check, a threads of 0 is the number of CPUs
+static int check_level = CHECK_DEFAULT;
+static unsigned int check_blocks = MM_CHECK_BLOCKS;
+static unsigned int check_threads;
+//the rolling check looks at next, NULL for the prolog
+static node* roll;
+//the quicklists of the threads that have any, see Quicklists
+static struct mm_quick* quick_threads;
+#ifdef HEAP_CHECK
+static unsigned long roll_clock;
+#endif
+
+/* The superblock sits at the bottom of a persistent heap, in front of the
+ * prolog, and records everything needed to pick the heap up again. All
+ * pointers are stored as offsets from lbound so the heap may be mapped
+ * at a different address next time. sb is NULL for an ordinary heap.
+ */
+struct super {
+    uint32_t magic;
+    uint32_t size;      //heap size in bytes
+    uint32_t prolog;
+    uint32_t root;      //set by mm_set_root
+    uint32_t htable;
+    uint32_t hcap;
+    uint32_t hfree;
+    uint32_t lists[LISTBOUND];
+    uint32_t shared;    //opened with mm_open_shared
+    pthread_mutex_t lock;
+};
+#define SUPER_MAGIC 0x6d6d6832
+#define SUPERSIZE ((sizeof(struct super) + DSIZE - 1) & ~(DSIZE - 1))
+static struct super* sb;
+
+/* Every public function runs under mm_lock unless it is NULL. Calls made
+ * while the lock is held only count lock_depth up, so they may nest. For
+ * a shared heap mm_lock is the mutex in the superblock, and taking it
+ * loads the allocator state from the superblock.
+ */
+static pthread_mutex_t* mm_lock;
+static __thread int lock_depth;
+static char shared;
+
+/* Size index: with -DSIZE_INDEX each free list from SIZE11 up, the ones
+ * searched past their first block, is mirrored in a dense array of block
+ * sizes with a parallel array of offsets. searchlist then finds the best
+ * fit by comparing 4 (SSE2) or 8 (AVX2) sizes at a time instead of taking
+ * a cache miss on every block it follows next to. A free block keeps its
+ * position in the array in the word after next, so deleting moves the
+ * last entry into its place. A class that outgrows INDEX_CAP entries
+ * goes back to walking its list until the list is empty again. The index
+ * lives in process memory, so a shared heap does not use it.
+ */
+#ifdef SIZE_INDEX
+#define INDEX_CAP 16384
+#define INDEXED (LISTBOUND - SIZE11)
+static uint32_t index_size[INDEXED][INDEX_CAP] __attribute__((aligned(32)));
+static uint32_t index_off[INDEXED][INDEX_CAP];
+static int index_count[INDEXED]; //-1 while the class is over INDEX_CAP
+#endif
+
 /* lbound is used to store the lower bound of the heap. Also serves as offset for 4 byte
  * pointers
  */
@@ -213,7 +488,14 @@ static inline void flist_delete(const node* n, node** list){
  * index into lists.
  */
 static inline void add(node* n){
-    flist_insert(n, lists + block_class(n));
+    int class = block_class(n);
+    flist_insert(n, lists + class);
+    heap_stats.classes[class].free_blocks++;
+    heap_stats.classes[class].free_bytes += block_size(n);
+#ifdef SIZE_INDEX
+    if(class >= SIZE11 && !shared)
+        index_insert(n, class - SIZE11);
+#endif
 }
 
 /* Deletes a block from the appropriate free list
@@ -221,9 +503,56 @@ static inline void add(node* n){
  * index into lists.
  */
 static inline void delete(node* n){
-    flist_delete(n, lists + block_class(n));
+    int class = block_class(n);
+    flist_delete(n, lists + class);
+    heap_stats.classes[class].free_blocks--;
+    heap_stats.classes[class].free_bytes -= block_size(n);
+#ifdef SIZE_INDEX
+    if(class >= SIZE11 && !shared)
+        index_delete(n, class - SIZE11, lists[class] == NULL);
+#endif
+}
+
+#ifdef SIZE_INDEX
+//the word after next in a free block holds its position in the index
+static inline uint32_t* index_slot(const node* n){
+    return (uint32_t*)(n + 1);
+}
+
+//appends n to the index of class i, where i counts from SIZE11
+static inline void index_insert(node* n, int i){
+    if(index_count[i] < 0)
+        return;
+    if(index_count[i] == INDEX_CAP){
+        index_count[i] = -1;
+        return;
+    }
+    index_size[i][index_count[i]] = block_size(n);
+    index_off[i][index_count[i]] = heap_off(n);
+    *index_slot(n) = index_count[i]++;
 }
 
+/* Removes n from the index of class i by moving the last entry into its
+ * place. empty tells whether the list is now empty, which lets a class
+ * that overflowed use the index again.
+ */
+static inline void index_delete(const node* n, int i, char empty){
+    uint32_t at, last;
+    if(index_count[i] < 0){
+        if(empty)
+            index_count[i] = 0;
+        return;
+    }
+    at = *index_slot(n);
+    last = --index_count[i];
+    if(at != last){
+        index_size[i][at] = index_size[i][last];
+        index_off[i][at] = index_off[i][last];
+        *index_slot(mm_off_to_ptr(index_off[i][at])) = at;
+    }
+}
+#endif
+
 /* Uses size class as an index into lists
  * to retrieve the appropriate free list
  */
@@ -245,12 +574,12 @@ static inline node** get_list_addr(const int p){
  */
 
 // Align p to a multiple of w bytes
-static inline void* align(const void const* p, unsigned char w) {
+static inline void* align(const void* p, size_t w) {
     return (void*)(((uintptr_t)(p) + (w-1)) & ~(w-1));
 }
 
 // Check if the given pointer is 8-byte aligned
-static inline int aligned(const void const* p) {
+static inline int aligned(const void* p) {
     return align(p, 8) == p;
 }
 
@@ -259,24 +588,70 @@ static int in_heap(const void* p) {
     return p <= mem_heap_hi() && p >= lbound;
 }
 
+// Take mm_lock, see its documentation
+static inline void lock(void) {
+#ifndef DRIVER
+    if(!mm_lock) boot();
+#endif
+    if(mm_lock && lock_depth++ == 0){
+        if(pthread_mutex_lock(mm_lock) == EOWNERDEAD)
+            lock_recover();
+        else if(shared) sb_load();
+    }
+}
+
+// Release mm_lock, publishing the allocator state if the heap is shared
+static inline void unlock(void) {
+    if(mm_lock && --lock_depth == 0){
+        if(shared) sb_store();
+        pthread_mutex_unlock(mm_lock);
+    }
+}
+
+/* Compressed pointers
+ * -------------------
+ * A pointer into the heap is stored as its 32 bit offset from lbound.
+ * The heap never grows past LIMIT and lbound never changes after mm_init,
+ * so an offset stays valid for as long as the block it refers to.
+ * Offset 0 is the padding word before the prolog and stands for NULL.
+ * Blocks sampled into guard pages lie in the space memlib keeps above the
+ * heap, which ends less than 4 GB past lbound, so they have offsets too.
+ * Blocks the allocator stores as offsets itself come from own_alloc,
+ * which never samples, so heap_off only takes blocks in the heap.
+ */
+static inline uint32_t heap_off(const void* p){
+    REQUIRES(p == NULL || in_heap(p));
+    return p ? (uint32_t)((long)p - (long)lbound) : 0;
+}
+
+unsigned int mm_ptr_to_off(const void* p){
+    if(mm_guard_owns(p))
+        return (uint32_t)((long)p - (long)lbound);
+    return heap_off(p);
+}
+
+void* mm_off_to_ptr(unsigned int off){
+    return off ? (void*)((long)lbound + off) : NULL;
+}
+
 //gets the next node on the free list after n
 static inline node* next(const node* n){
-    return n->next ? (node*)((long)lbound + n->next) : NULL;
+    return mm_off_to_ptr(n->next);
 }
 
 //sets the node that comes after n on the free to val
 static inline void setnext(node* n, node* val){
-    n->next = (uint32_t)(long)val;
+    n->next = heap_off(val);
 }
 
 //gets the node that comes before n on the free list
 static inline node* prev(const node* n){
-    return n->prev ? (node*)((long)lbound + n->prev) : NULL;
+    return mm_off_to_ptr(n->prev);
 }
 
 //sets the node that comes before n on the free list
 static inline void setprev(node* n, node* val){
-    n->prev = (uint32_t)(long)val;
+    n->prev = heap_off(val);
 }
 
 //gets the size field of a blocks header
@@ -294,65 +669,47 @@ static inline node* block_next(const node* n){
     return (n == epilog)? NULL : (node*)((long) n + block_size(n) + DSIZE);
 }
 
+#ifndef BITMAP_TAGS
 /* gets the previous adjacent block in the heap
- * NOTE: there are two block classes that do not use a footer
- * to determine where the previous block begins. When one of these
- * blocks is set up in the heap it sets 2 bits in the header of the
- * next block PFIXED and SZCLASS. 
- *   PFIXED specifies that the previous block belongs to a fixed size
- *       class that has no footer.
- *   SZCLASS specifies one of 2 size classes the previous block belongs to
+ * NOTE: only free blocks have a footer, so this may only be called when
+ * the previous block is free. Every block header carries PREV_ALLOC, which
+ * is set when the block before it in the heap is allocated. Check it with
+ * prev_free() before calling this function.
  *
- * Using these flags the previous blocks header address is computed.
- * Otherwise, the previous block is located using a footer.
+ * Using the footer of the previous block its header address is computed.
  */
 static inline node* block_prev(const node* n){
-    if(n!=prolog){
-        if(n->head & PFIXED) 
-            return (node*)((long)n - get_fixed_bucket_offset(n->head & SZCLASS));
-        return (node*)((long)n - (block_size((node*)(((uint32_t*)n)-1))+DSIZE));
-    }
-    return NULL;
+    REQUIRES(n != prolog && prev_free(n));
+    return (node*)((long)n - (block_size((node*)(((uint32_t*)n)-1))+DSIZE));
 }
 
-/* Gets the offset of a fixed size allocation class
- */
-static inline char get_fixed_bucket_offset(const char class){
-    switch(class >> 2){
-    case SIZE4:
-        return 16;
-    case SIZE5:
-        return 24;
-    default:
-        return 0; //I hope it never comes to this
-    }
+//returns 1 if the block before n in the heap is free
+static inline char prev_free(const node* n){
+    return !(n->head & PREV_ALLOC);
 }
 
-/* In the general case this function marks the footer of a block to make it
- * identical to the block header.
- * However if the block belongs to a special fixed size class it doesn't mark
- * a footer and instead sets PFIXED and SZCLASS appropriately in the header of
- * the next block.
+/* Marks n's boundary tags for its neighbours.
+ * A free block copies its header into its footer so the next block can find
+ * it when coalescing, and clears PREV_ALLOC in the header of the next block.
+ * An allocated block has no footer, it only sets PREV_ALLOC in the header
+ * of the next block.
  */
 static inline void block_mark(node* n){
-    char class = block_class(n);
-    node* m;
-    if(class < SIZE6){
-        //mark PFIXED AND SZCLASS
-        m = block_next(n);
-        if(m){
-            m->head = class ? m->head | SZCLASS : m->head & ~SZCLASS; //SZCLASS set when class is SIZE5
-            m->head |= PFIXED;
-        }
-    }
-    else{ 
+    node* m = block_next(n);
+    if(!(n->head & ALLOC)){
         //mark footer
         ((node*)((long)n +block_size(n)+WSIZE))->head = n->head;
-        m = block_next(n);
-        if(m){
-            m->head &= ~(PFIXED|SZCLASS);
-        }
+        if(m) m->head &= ~PREV_ALLOC;
     }
+    else if(m) m->head |= PREV_ALLOC;
+}
+
+/* Boundary tags live inside the blocks, so there is nothing to clear
+ * when a block is absorbed by a neighbour or changes size.
+ */
+static inline void block_unmark(const node* n){
+    (void)n;
+    check_forget(n);
 }
 
 //returns 1 if n is a free block
@@ -360,6 +717,117 @@ static inline char block_free(const node* n){
     return !(n->head & ALLOC);
 }
 
+#else
+/* Out of band boundary tags
+ * -------------------------
+ * When compiled with -DBITMAP_TAGS the boundary tags are kept in two
+ * bitmaps beside the heap instead of in footers and PREV_ALLOC bits.
+ * Every bit describes one 8 byte granule counted from lbound, and since
+ * every block header sits 4 bytes into a granule each block starts in a
+ * granule of its own.
+ *   bm_start has the bit of the first granule of every block set.
+ *   bm_alloc has the bits of the first and last granule of every
+ *       allocated block set.
+ * Whether either neighbour of a block is free is then a single bit test,
+ * and neither neighbours header has to be read to find out. Headers still
+ * hold the size of their own block.
+ */
+#define BM_WORDS (LIMIT/DSIZE/64 + 1)
+static uint64_t bm_start[BM_WORDS];
+static uint64_t bm_alloc[BM_WORDS];
+
+//gets the granule index of the granule holding n's header
+static inline size_t granule(const node* n){
+    return ((long)n - (long)lbound) >> 3;
+}
+
+//gets the index of the last granule of n
+static inline size_t granule_last(const node* n){
+    return granule(n) + (block_size(n) >> 3);
+}
+
+static inline int bm_test(const uint64_t* bm, size_t g){
+    return (bm[g >> 6] >> (g & 63)) & 1;
+}
+
+static inline void bm_set(uint64_t* bm, size_t g){
+    bm[g >> 6] |= 1UL << (g & 63);
+}
+
+static inline void bm_clear(uint64_t* bm, size_t g){
+    bm[g >> 6] &= ~(1UL << (g & 63));
+}
+
+/* Clears the bits of granules lo through hi in both bitmaps. Used when the
+ * heap grows over granules that may hold bits from a previous heap.
+ */
+static void bm_clear_range(size_t lo, size_t hi){
+    for(; lo <= hi && (lo & 63); lo++){
+        bm_clear(bm_start, lo);
+        bm_clear(bm_alloc, lo);
+    }
+    for(; lo + 63 <= hi; lo += 64){
+        bm_start[lo >> 6] = 0;
+        bm_alloc[lo >> 6] = 0;
+    }
+    for(; lo <= hi; lo++){
+        bm_clear(bm_start, lo);
+        bm_clear(bm_alloc, lo);
+    }
+}
+
+/* gets the previous adjacent block in the heap
+ * The start of the previous block is the closest start bit below n's
+ * granule. The prolog always has its start bit set so the scan ends.
+ */
+static inline node* block_prev(const node* n){
+    size_t g = granule(n) - 1;
+    size_t w = g >> 6;
+    uint64_t bits = bm_start[w] & (~0UL >> (63 - (g & 63)));
+    REQUIRES(n != prolog);
+    while(!bits)
+        bits = bm_start[--w];
+    g = (w << 6) + 63 - __builtin_clzl(bits);
+    return (node*)((long)lbound + (g << 3) + WSIZE);
+}
+
+//returns 1 if the block before n in the heap is free
+static inline char prev_free(const node* n){
+    return !bm_test(bm_alloc, granule(n) - 1);
+}
+
+/* Marks n's boundary tags in the bitmaps. The start bit is always set,
+ * the alloc bits of the first and last granule follow n's header.
+ */
+static inline void block_mark(node* n){
+    size_t g = granule(n), e = granule_last(n);
+    bm_set(bm_start, g);
+    if(n->head & ALLOC){
+        bm_set(bm_alloc, g);
+        bm_set(bm_alloc, e);
+    } else {
+        bm_clear(bm_alloc, g);
+        bm_clear(bm_alloc, e);
+    }
+}
+
+/* Clears n's bits before it is absorbed by a neighbour or changes size,
+ * so that only the first and last granule of a block ever have bits set.
+ */
+static inline void block_unmark(const node* n){
+    size_t g = granule(n);
+    check_forget(n);
+    bm_clear(bm_start, g);
+    bm_clear(bm_alloc, g);
+    bm_clear(bm_alloc, granule_last(n));
+}
+
+//returns 1 if n is a free block
+static inline char block_free(const node* n){
+    return !bm_test(bm_alloc, granule(n));
+}
+#endif
+
 /* Determines a size class for an allocation based
  * on a size.
  */
@@ -378,19 +846,74 @@ static inline char get_class(const size_t size){
         return SIZE9;
     else if(size <= 56)
         return SIZE10;
-    else if(size <= 72)
+    else if(size <= CLASS11_MAX)
         return SIZE11;
-    else if(size <= 104)
+    else if(size <= CLASS12_MAX)
         return SIZE12;
-    else if(size <= 304)
+    else if(size <= CLASS13_MAX)
         return SIZE13;
-    else if(size <= 504)
+    else if(size <= CLASS14_MAX)
         return SIZE14;
-    else if(size <= 1000)
+    else if(size <= CLASS15_MAX)
         return SIZE15;
     else return SIZEN;
 }
 
+/* Rounds a requested size up to the payload size of the block that will
+ * hold it. Allocated blocks have no footer so the last 4 bytes of a block
+ * belong to the payload, a block of payload size s can hold s + 4 bytes.
+ * Free blocks need room for their free list pointers, so the smallest
+ * block has a payload size of 8.
+ */
+static inline size_t adjust_size(size_t size){
+    size = (size + 3) & ~7;
+    return size < 8 ? 8 : size;
+}
+
+/* Fails a request for more than LIMIT bytes with ENOMEM. Entry points
+ * check this before rounding a size up, which wraps around near SIZE_MAX.
+ */
+static inline int oversized(size_t size){
+    if(size <= LIMIT)
+        return 0;
+    errno = ENOMEM;
+    return 1;
+}
+
+//the counters of the class of n
+static inline struct mm_class_stats* class_stats(const node* n){
+    return &heap_stats.classes[(int)block_class(n)];
+}
+
+/* Counts n as allocated, or with count -1 takes back a count of it. The
+ * bytes of a block include its header, so splitting an allocated block
+ * and counting the parts leaves live_bytes where it was.
+ */
+static inline void stat_alloc(const node* n, long count){
+    struct mm_class_stats* c = class_stats(n);
+    c->allocs += count;
+    c->live_bytes += count * (block_size(n) + DSIZE);
+}
+
+//counts the free of the allocated block n
+static inline void stat_free(const node* n){
+    struct mm_class_stats* c = class_stats(n);
+    c->frees++;
+    c->live_bytes -= block_size(n) + DSIZE;
+}
+
+/* Live bytes are only added up when they are read, so peak_live is the
+ * most seen at those times and whenever the heap grows.
+ */
+static void peak_sample(void){
+    size_t live = 0;
+    int i;
+    for(i = 0; i < MM_CLASSES; i++)
+        live += heap_stats.classes[i].live_bytes;
+    if(live > heap_stats.peak_live)
+        heap_stats.peak_live = live;
+}
+
 /*
  *  Malloc Implementation
  *  ---------------------
@@ -403,8 +926,28 @@ static inline char get_class(const size_t size){
 int mm_init(void) {
     //alocate some blocks so they are ready for the first malloc
     long addr = (long) mem_sbrk(4*WSIZE);
-    flist4 = flist5 = flist6 = flist7 = flist8 = flist9 = flist10 = flist11 = \
-        flist12 = flist13 = flist14 = flist15 = flistn = NULL;
+    size_t spare_len;
+    char* spare;
+    int i;
+    for(i = 0; i < LISTBOUND; i++)
+        lists[i] = NULL;
+    clock_ops = 0;
+    memset(last_free, 0, sizeof(last_free));
+    heap_color = 0;
+    policy_reset();
+    memset(&heap_stats, 0, sizeof(heap_stats));
+    htable = NULL;
+    hcap = hfree = 0;
+    hcursor = NULL;
+    pcursor = NULL;
+    roll = NULL;
+    memset(&mm_quick, 0, sizeof(mm_quick));
+    quick_threads = NULL;
+    spare = mem_spare(&spare_len);
+    mm_guard_reset(spare, spare_len);
+#ifdef SIZE_INDEX
+    memset(index_count, 0, sizeof(index_count));
+#endif
     if(addr == -1){
         fprintf(stderr,"mm_init failed calling mem_sbrk\n");
         return -1;
@@ -412,13 +955,18 @@ int mm_init(void) {
     
     uint32_t* p = (uint32_t*) addr;
     p[0] = 0;
-    p[1] = ALLOC;
+    p[1] = ALLOC | PREV_ALLOC;
     p[2] = ALLOC;
-    p[3] = ALLOC;
+    p[3] = ALLOC | PREV_ALLOC;
     
     prolog = (node*) &p[1];
     epilog = (node*) &p[3];
     lbound = mem_heap_lo();
+#ifdef BITMAP_TAGS
+    bm_clear_range(granule(prolog), granule(epilog));
+    block_mark(prolog);
+    block_mark(epilog);
+#endif
     checkheap(1);
     return 0;
 }
@@ -427,77 +975,421 @@ int mm_init(void) {
  * malloc
  */
 void *malloc (size_t size) {
-    node *n;
+    void* p = NULL;
+    if(oversized(size))
+        return NULL;
+    lock();
+    if(--mm_guard_next <= 0 && sb == NULL)
+        p = mm_guard_alloc(size, __builtin_return_address(0));
+    if(p == NULL)
+        p = place(size, DEFAULT_HINT);
+    unlock();
+    return p;
+}
+
+/* Allocate a block with a hint about how long it will live. See the
+ * documentation for NO_HINT.
+ */
+void *mm_malloc_hint(size_t size, int hint){
+    void* p;
+    if(oversized(size))
+        return NULL;
+    lock();
+    p = place(size, hint);
+    unlock();
+    return p;
+}
+
+/* Allocates a block for the allocator's own use, like arena chunks, pool
+ * slabs and the handle table. It is never sampled into guard pages, so it
+ * is in the heap and has an offset.
+ */
+static void *own_alloc(size_t size){
+    return mm_malloc_hint(size, DEFAULT_HINT);
+}
+
+//gets the power of two size bucket a request falls in
+static inline int lifetime_bucket(size_t size){
+    return size ? 63 - __builtin_clzl(size) : 0;
+}
+
+/* Predicts whether a block of size bytes will be short or long lived
+ * by looking at when a block of a similar size was last freed.
+ */
+int mm_predict_lifetime(size_t size){
+    unsigned long last = last_free[lifetime_bucket(adjust_size(size))];
+    if(last && clock_ops - last <= LIFETIME_WINDOW)
+        return MM_SHORT_LIVED;
+    return MM_LONG_LIVED;
+}
+
+/* Does the work of malloc. Blocks hinted as short lived are carved from
+ * the high end of a free block that is split, exact fits and blocks taken
+ * from mem_sbrk ignore the hint, see mm_malloc_hint in mm.h.
+ */
+static void *place(size_t size, int hint){
+    node *n, *w;
     long res;
-    char p;
+    size_t faulted;
+    char p, high;
     checkheap(1);  // Let's make sure the heap is ok!
-    size = (size + 7) & ~7; //align size
-    if(size <= 20 && size > 12) size = 16;
-    if(size <= 12) size = 8;
-    if(size<8)return NULL;
+    if(hint == MM_LIFETIME_AUTO)
+        hint = mm_predict_lifetime(size);
+    clock_ops++;
+    if(stats_page && (clock_ops & (STATS_EVERY - 1)) == 0)
+        stats_store();
+    size = adjust_size(size);
+    high = hint == NO_HINT ? size <= SPLIT_HIGH : hint == MM_SHORT_LIVED;
     p = get_class(size);
-    n = searchlist(get_list_addr(p), size);
+    n = searchlist(get_list_addr(p), size, high);
     if(n!=NULL) 
         return n;
     //carve out a chunk of a large block and allocate it if possible
     if(p != SIZEN){
-        n = searchlist(get_list_addr(SIZEN), size);
+        heap_stats.classes[(int)p].fallbacks++;
+        n = searchlist(get_list_addr(SIZEN), size, high);
         if(n != NULL) return n;
     }
     //Requested size is not found on a free list call sbrk for a variable
     //size block, store its size in its header so that it can be
     //placed accurately measured when it is freed.
-    size_t up = size;
+    //A medium block that would straddle a page is moved onto the next page
+    //and the bytes it skips become a free block, unless that free block
+    //would have to be coalesced with the one before it.
+    size_t pad = 0;
+    if(PAGE_SLACK && size > 56 && size <= CLASS15_MAX && !prev_free(epilog))
+        pad = page_pad(epilog, size);
+#if CACHE_COLORS
+    if(size >= COLOR_MIN && !prev_free(epilog))
+        pad = color_pad(epilog);
+#endif
+    size_t up = size + pad;
     up += DSIZE; //account for metadata
     if((up + mem_heapsize()) > LIMIT){
+#ifdef DRIVER
         fprintf(stderr,"out of mem\n");
         printheap();
+#endif
+        errno = ENOMEM;
         return NULL;
     }
+    faulted = mem_inline_faulted();
     res = (long)mem_sbrk(up);
     if(res == -1){
+#ifdef DRIVER
         fprintf(stderr,"mem_sbrk failed\n");
+#endif
         return NULL;
     }
-    n = (node*) (res-WSIZE);
+    heap_stats.grows++;
+    heap_stats.faulted += mem_inline_faulted() - faulted;
+    if(mem_heapsize() > heap_stats.peak_heap)
+        heap_stats.peak_heap = mem_heapsize();
+    if(stats_page)
+        stats_store();
+    w = n = (node*) (res-WSIZE);
     n->head = size | (epilog->head & METAMASK); 
+    if(pad){
+        w->head = (pad - DSIZE) | PREV_ALLOC;
+        n = (node*)((long)w + pad);
+        n->head = size | ALLOC;
+    }
     epilog = (node*)((long)mem_heap_hi()-3);
-    epilog->head = ALLOC;
+    epilog->head = ALLOC | PREV_ALLOC;
+#ifdef BITMAP_TAGS
+    bm_clear_range(granule(w), granule(epilog));
     block_mark(n);
+    block_mark(epilog);
+#endif
+    if(pad){
+        block_mark(w);
+        add(w);
+        class_stats(n)->splits++;
+    }
+    stat_alloc(n, 1);
+    peak_sample();
+    checkblock(n);
     checkheap(1);
     return (void*) &n->prev;
 }
 
 /* Search a free list for a node that can accomodate an allocation of size size.
+ * When high is set a block that is split gives its high end.
  */
-void* searchlist(node** list, size_t size){
+void* searchlist(node** list, size_t size, char high){
     node* n, *m, *start;
-    size_t best, tmp;
-    char count;
+    size_t best, first, tmp;
+    unsigned int count, look, visited = 0;
+    int class = list - lists;
     start = n = *list;
-    if(n && (block_class(n) < SIZE11)) return found(n);
+    if(n && (block_class(n) < SIZE11)){
+        heap_stats.classes[class].search_steps++;
+        return found(n);
+    }
+#ifdef SIZE_INDEX
+    if(n && !shared && index_count[list - lists - SIZE11] >= 0){
+        heap_stats.classes[class].search_steps++;
+        n = index_search(list - lists - SIZE11, size);
+        return n ? take(n, size, block_size(n), high) : NULL;
+    }
+#endif
+    look = policy[class].p.lookahead;
     while(n){
-        if((best = block_size(n)) >= size){
+        visited++;
+        if((first = best = block_size(n)) >= size){
             count = 0;
             m = next(n);
-            while((count++ < LOOKAHEAD) && m && (m != start)){
+            while(count < look && best != size && m && (m != start)){
+                count++;
                 if(((tmp = block_size(m)) < best) && (tmp >= size) ){
                     best = tmp;
                     n = m;
                 }
                 m = next(m);
             }
-            if((best - size) >= 16)
-                return carve(n, size, best - size - DSIZE);
-            return found(n);
+            adapt(class, size, first - best, best, visited + count,
+                  count == look && m != start);
+            return take(n, size, best, high);
         }
         n = next(n);
         if(n == start)
             break;
     }
+    if(visited){
+        policy[class].p.searches++;
+        policy[class].p.visited += visited;
+    }
     return NULL;
 }
 
+//starts every class over at its default lookahead
+static void policy_reset(void){
+    int i;
+    memset(policy, 0, sizeof(policy));
+    for(i = SIZE11; i < LISTBOUND; i++)
+        policy[i].p.lookahead = LOOKAHEAD;
+}
+
+//the most lookahead allowed at the current heap size
+static unsigned int policy_bound(void){
+    size_t bound = LOOKAHEAD * (1 + mem_heapsize() / ADAPT_HEAP);
+    return bound < LOOKAHEAD_MAX ? bound : LOOKAHEAD_MAX;
+}
+
+/* Records a search of class that found a block of best bytes for size
+ * bytes after looking at visited blocks, where the first block that fit
+ * was saved bytes larger, and adjusts the lookahead of the class at the
+ * end of a window. cut is set if the lookahead ended the search.
+ */
+static void adapt(int class, size_t size, size_t saved, size_t best,
+                  unsigned int visited, int cut){
+    unsigned int look;
+    policy[class].p.searches++;
+    policy[class].p.visited += visited;
+    policy[class].p.saved += saved;
+    policy[class].window++;
+    policy[class].cut += cut;
+    policy[class].wanted += size;
+    policy[class].saved += saved;
+    if(best - size >= 16){
+        policy[class].p.splits++;
+        policy[class].splits++;
+    }
+    if(policy[class].window < ADAPT_WINDOW)
+        return;
+    look = policy[class].p.lookahead;
+    if(look == 0){
+        if(policy[class].splits > ADAPT_WINDOW / 2 &&
+           policy[class].cut > ADAPT_WINDOW / 4)
+            look = 1;
+    } else if(policy[class].saved < policy[class].wanted / ADAPT_GAIN / 4)
+        look /= 2;
+    else if(policy[class].saved >= policy[class].wanted / ADAPT_GAIN &&
+            policy[class].cut > ADAPT_WINDOW / 4)
+        look *= 2;
+    policy[class].p.bound = policy_bound();
+    if(look > policy[class].p.bound)
+        look = policy[class].p.bound;
+#if LOOKAHEAD_MIN > 0
+    if(look < LOOKAHEAD_MIN)
+        look = LOOKAHEAD_MIN;
+#endif
+    if(look != policy[class].p.lookahead){
+        policy[class].p.lookahead = look;
+        policy[class].p.changes++;
+    }
+    policy[class].window = policy[class].cut = policy[class].splits = 0;
+    policy[class].wanted = policy[class].saved = 0;
+}
+
+/* Copies the search policy of class cls, 0 to MM_CLASSES - 1, to out,
+ * with the number and bytes of the free blocks in it. Returns -1 if there
+ * is no such class.
+ */
+int mm_get_class_policy(int cls, struct mm_class_policy* out){
+    node *n, *start;
+    if(cls < 0 || cls >= LISTBOUND)
+        return -1;
+    lock();
+    *out = policy[cls].p;
+    if(cls >= SIZE11)
+        out->bound = policy_bound();
+    out->free_blocks = out->free_bytes = 0;
+    start = n = get_list(cls);
+    while(n){
+        out->free_blocks++;
+        out->free_bytes += block_size(n);
+        n = next(n);
+        if(n == start)
+            break;
+    }
+    unlock();
+    return 0;
+}
+
+/* Fills in out from heap_stats and what the counters leave out: the
+ * search steps of the classes with a search policy are counted there, and
+ * other processes change the free lists of a persistent or shared heap
+ * too, so those are counted again from the lists.
+ */
+static void stats_collect(struct mm_stats* out){
+    node *n, *start;
+    int i;
+    peak_sample();
+    *out = heap_stats;
+    out->heap_size = mem_heapsize();
+    for(i = 0; i < LISTBOUND; i++){
+        out->live_bytes += out->classes[i].live_bytes;
+        out->classes[i].search_steps += policy[i].p.visited;
+        if(sb == NULL)
+            continue;
+        out->classes[i].free_blocks = out->classes[i].free_bytes = 0;
+        start = n = get_list(i);
+        while(n){
+            out->classes[i].free_blocks++;
+            out->classes[i].free_bytes += block_size(n);
+            n = next(n);
+            if(n == start)
+                break;
+        }
+    }
+}
+
+//copies the allocator statistics to out
+void mm_get_stats(struct mm_stats* out){
+    lock();
+    stats_collect(out);
+    unlock();
+}
+
+/* Allocates size bytes from the free block n with a payload of best
+ * bytes, splitting it when the rest can be a block of its own.
+ */
+static inline void* take(node* n, size_t size, size_t best, char high){
+    size_t pad;
+    if((best - size) >= 16){
+        if(PAGE_SLACK && size > 56 && size <= CLASS15_MAX &&
+                (pad = page_pad(n, size)) && pad + size <= best)
+            return carve_at(n, pad, size, best);
+        if(high)
+            return carve_high(n, size, best - size - DSIZE);
+        return carve(n, size, best - size - DSIZE);
+    }
+    return found(n);
+}
+
+#ifdef SIZE_INDEX
+//position of the first entry equal to want in sizes[0..count), -1 if none
+static inline int index_find(const uint32_t* sizes, int count, uint32_t want){
+    int i = 0, mask;
+#if defined(__AVX2__)
+    __m256i w = _mm256_set1_epi32(want);
+    for(; i + 8 <= count; i += 8){
+        __m256i v = _mm256_load_si256((const __m256i*)(sizes + i));
+        if((mask = _mm256_movemask_epi8(_mm256_cmpeq_epi32(v, w))))
+            return i + __builtin_ctz(mask) / 4;
+    }
+#elif defined(__SSE2__)
+    __m128i w = _mm_set1_epi32(want);
+    for(; i + 4 <= count; i += 4){
+        __m128i v = _mm_load_si128((const __m128i*)(sizes + i));
+        if((mask = _mm_movemask_epi8(_mm_cmpeq_epi32(v, w))))
+            return i + __builtin_ctz(mask) / 4;
+    }
+#endif
+    (void)mask;
+    for(; i < count; i++)
+        if(sizes[i] == want)
+            return i;
+    return -1;
+}
+
+/* Best fit through the index of class i: the smallest block with a
+ * payload of at least size bytes, NULL if there is none. A block of
+ * exactly size bytes ends the search early.
+ */
+static node* index_search(int i, size_t size){
+    const uint32_t* sizes = index_size[i];
+    int count = index_count[i], k = 0, at;
+    uint32_t want = size, best = UINT32_MAX;
+    if((at = index_find(sizes, count, want)) >= 0)
+        return mm_off_to_ptr(index_off[i][at]);
+#if defined(__AVX2__)
+    //sizes below want are or'ed up to UINT32_MAX so a min finds the fit
+    __m256i w = _mm256_set1_epi32(want), min = _mm256_set1_epi32(-1);
+    uint32_t lanes[8];
+    for(; k + 8 <= count; k += 8){
+        __m256i v = _mm256_load_si256((const __m256i*)(sizes + k));
+        __m256i small = _mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(v, w), v),
+                                         _mm256_set1_epi32(-1));
+        min = _mm256_min_epu32(min, _mm256_or_si256(v, small));
+    }
+    _mm256_storeu_si256((__m256i*)lanes, min);
+    for(at = 0; at < 8; at++)
+        if(lanes[at] < best)
+            best = lanes[at];
+#elif defined(__SSE2__)
+    /* SSE2 only compares signed integers, flipping the top bit maps the
+     * unsigned order onto the signed one */
+    __m128i bias = _mm_set1_epi32(INT32_MIN);
+    __m128i w = _mm_set1_epi32((want - 1) ^ 0x80000000), min = _mm_set1_epi32(INT32_MAX);
+    uint32_t lanes[4];
+    for(; k + 4 <= count; k += 4){
+        __m128i v = _mm_xor_si128(_mm_load_si128((const __m128i*)(sizes + k)), bias);
+        __m128i fits = _mm_cmpgt_epi32(v, w);
+        __m128i less = _mm_and_si128(fits, _mm_cmplt_epi32(v, min));
+        min = _mm_or_si128(_mm_and_si128(less, v), _mm_andnot_si128(less, min));
+    }
+    _mm_storeu_si128((__m128i*)lanes, _mm_xor_si128(min, bias));
+    for(at = 0; at < 4; at++)
+        if(lanes[at] < best)
+            best = lanes[at];
+#endif
+    for(; k < count; k++)
+        if(sizes[k] >= want && sizes[k] < best)
+            best = sizes[k];
+    if(best == UINT32_MAX)
+        return NULL;
+    return mm_off_to_ptr(index_off[i][index_find(sizes, count, best)]);
+}
+
+//fills the index from the free lists of a heap that was loaded from a file
+static void index_rebuild(void){
+    node *n, *start;
+    int i;
+    for(i = 0; i < INDEXED; i++){
+        index_count[i] = 0;
+        start = n = lists[i + SIZE11];
+        while(n){
+            index_insert(n, i);
+            n = next(n);
+            if(n == start)
+                break;
+        }
+    }
+}
+#endif
+
 /* Divide n into two nodes. The first with a payload size specified by
  * s0, the second with a paylod of s1 bytes. Returns a pointer to the first
  * node in order for it to be allocated and then adds the second node to
@@ -506,72 +1398,210 @@ void* searchlist(node** list, size_t size){
 void* carve(node* n, size_t s0, size_t s1){
      node* m;
      delete(n);
-     n->head = s0 | (n->head & (PFIXED|SZCLASS)) | ALLOC;
+     n->head = s0 | (n->head & PREV_ALLOC) | ALLOC;
+#ifdef BITMAP_TAGS
      block_mark(n);
+#endif
      m = block_next(n);
-     m->head = s1 | (m->head & (PFIXED|SZCLASS));
+     m->head = s1 | PREV_ALLOC;
      block_mark(m);
      add(m);
+     class_stats(n)->splits++;
+     stat_alloc(n, 1);
+     checkblock(n);
+     checkblock(m);
      checkheap(1);
      return &n->prev;
 }
 
-/* Remove the block from it's list
- * mark the header to indicate size class
- * mark next block to let it know this blocks size?
- * return a pointer to the 8 byte aligned address just beyond the nodes metadata
+/* Divide n into two nodes like carve() but allocate the one at the high
+ * end. The first node keeps a payload of s1 bytes and goes back on a free
+ * list, the second with a payload of s0 bytes is returned to be allocated.
  */
-static inline void* found(node *n){
-    //suitable block found
-    delete(n);
-    n->head |= ALLOC;
-    block_mark(n);
-    checkheap(1);
-    return (void*) &n->prev;
+void* carve_high(node* n, size_t s0, size_t s1){
+     node* m;
+     delete(n);
+     block_unmark(n);
+     n->head = s1 | (n->head & PREV_ALLOC);
+     block_mark(n);
+     m = block_next(n);
+     m->head = s0 | ALLOC;
+     block_mark(m);
+     add(n);
+     class_stats(m)->splits++;
+     stat_alloc(m, 1);
+     checkblock(n);
+     checkblock(m);
+     checkheap(1);
+     return &m->prev;
 }
 
-/*
- * free
+/* Returns how many bytes the payload of an allocation of size bytes
+ * placed at n has to move up to start on the next page boundary, or 0 if
+ * it does not straddle one or would have to move further than PAGE_SLACK.
+ * The skipped bytes must be able to hold a free block of their own.
  */
-void free (void *ptr) {
+static inline size_t page_pad(const node* n, size_t size){
+    uintptr_t p = (uintptr_t)&n->prev;
+    uintptr_t b = (p + size + WSIZE - 1) & ~(uintptr_t)(PAGESIZE - 1);
+    if(b <= p || b - p > PAGE_SLACK || b - p < 16)
+        return 0;
+    return b - p;
+}
+
+/* Returns the offset in bytes of the color *c and moves *c on to the next
+ * one, see CACHE_COLORS. Always 0 when coloring is off.
+ */
+static inline size_t next_color(unsigned int* c){
+#if CACHE_COLORS
+    size_t off = *c * CACHE_LINE;
+    *c = (*c + 1) % CACHE_COLORS;
+    return off;
+#else
+    (void)c;
+    return 0;
+#endif
+}
+
+#if CACHE_COLORS
+/* Returns how many bytes the payload of a block placed at n has to move
+ * up to start on the next color of the heap. The skipped bytes must be
+ * able to hold a free block of their own.
+ */
+static inline size_t color_pad(const node* n){
+    uintptr_t span = CACHE_COLORS * CACHE_LINE;
+    uintptr_t p = (uintptr_t)&n->prev;
+    size_t pad = (next_color(&heap_color) + span - p % span) % span;
+    return pad && pad < 16 ? pad + span : pad;
+}
+#endif
+
+/* Divide n, which has a payload of best bytes, into up to three nodes.
+ * The first is a free node of pad bytes including its metadata, the second
+ * is allocated with a payload of s0 bytes and is returned. Whatever is left
+ * becomes a third free node, or is given to the allocated node when it is
+ * too small to be a block of its own.
+ */
+void* carve_at(node* n, size_t pad, size_t s0, size_t best){
+     node *m, *w;
+     size_t rest = best - pad - s0;
+     delete(n);
+     block_unmark(n);
+     n->head = (pad - DSIZE) | (n->head & PREV_ALLOC);
+     block_mark(n);
+     m = block_next(n);
+     if(rest >= 16){
+         m->head = s0 | ALLOC;
+         block_mark(m);
+         w = block_next(m);
+         w->head = (rest - DSIZE) | PREV_ALLOC;
+         block_mark(w);
+         add(w);
+         class_stats(m)->splits++;
+     } else {
+         m->head = (s0 + rest) | ALLOC;
+         block_mark(m);
+     }
+     add(n);
+     class_stats(m)->splits++;
+     stat_alloc(m, 1);
+     checkblock(n);
+     checkblock(m);
+     checkheap(1);
+     return &m->prev;
+}
+
+/* Remove the block from it's list
+ * mark the header as allocated
+ * mark next block to let it know the previous block is allocated
+ * return a pointer to the 8 byte aligned address just beyond the nodes metadata
+ */
+static inline void* found(node *n){
+    //suitable block found
+    delete(n);
+    n->head = (n->head | ALLOC) & ~PURGED;
+    block_mark(n);
+    stat_alloc(n, 1);
+    checkblock(n);
+    checkheap(1);
+    return (void*) &n->prev;
+}
+
+/*
+ * free
+ */
+void free (void *ptr) {
+    lock();
+    if(mm_guard_owns(ptr))
+        mm_guard_free(ptr, __builtin_return_address(0));
+    else
+        release(ptr);
+    unlock();
+}
+
+//does the work of free
+static void release(void *ptr) {
     size_t size;
     node *next, *prev;
     if (ptr == NULL) {
         return;
     }
+    //a sampled block that went through a quicklist
+    if (mm_guard_owns(ptr)) {
+        mm_guard_free(ptr, NULL);
+        return;
+    }
+#ifndef DRIVER
+    //memory the dynamic linker got before the library was in place
+    if (!in_heap(ptr)) {
+        return;
+    }
+#endif
     checkheap(1);
     node *n = (node*)(((long)ptr)-WSIZE);
+    checkblock(n);
+    last_free[lifetime_bucket(block_size(n))] = ++clock_ops;
+    if(stats_page && (clock_ops & (STATS_EVERY - 1)) == 0)
+        stats_store();
+    stat_free(n);
     //Use the header to free the block
     //and place the block in the free list
-    n->head = n->head & ~ALLOC;
+    n->head = n->head & ~(ALLOC|MOVABLE);
     next = block_next(n);
-    prev = block_prev(n);
+    prev = prev_free(n) ? block_prev(n) : NULL;
+    class_stats(n)->coalesces += (prev != NULL) + block_free(next);
+    block_unmark(n);
     if(block_free(next)){
         delete(next);
-        if(block_free(prev)){
+        block_unmark(next);
+        if(prev){
             delete(prev);
+            block_unmark(prev);
             size = get_combined_size3(prev, n, next);
-            prev->head = size | (prev->head & METAMASK);
+            prev->head = size | (prev->head & PREV_ALLOC);
             block_mark(prev);
             add(prev);
         } else {
             size = get_combined_size2(n, next);
-            n->head = size | (n->head & (PFIXED | SZCLASS));
+            n->head = size | (n->head & PREV_ALLOC);
             block_mark(n);
             add(n);
         }
     } else {
-        if(block_free(prev)){
+        if(prev){
             delete(prev);
+            block_unmark(prev);
             size = get_combined_size2(prev, n);
-            prev->head = size | (prev->head & METAMASK);
+            prev->head = size | (prev->head & PREV_ALLOC);
             block_mark(prev);
             add(prev);
         }
         else{
+            block_mark(n);
             add(n);
         }
     }
+    checkblock(prev ? prev : n);
     checkheap(1);
 }
 
@@ -600,6 +1630,26 @@ static inline size_t get_combined_size2(const node* n, const node* m){
  * realloc
  */
 void *realloc(void *oldptr, size_t size) {
+    void* p;
+    size_t old;
+    if(oversized(size))
+        return NULL;
+    lock();
+    if(mm_guard_owns(oldptr)){
+        p = size ? malloc(size) : NULL;
+        if(p || size == 0){
+            old = mm_guard_size(oldptr);
+            mm_copy(p, oldptr, size < old ? size : old);
+            mm_guard_free(oldptr, __builtin_return_address(0));
+        }
+    } else
+        p = resize(oldptr, size);
+    unlock();
+    return p;
+}
+
+//does the work of realloc
+static void *resize(void *oldptr, size_t size) {
     void* newptr;
     size_t oldsize, newsz;
     node* old, *prev, *next;
@@ -611,58 +1661,81 @@ void *realloc(void *oldptr, size_t size) {
         return malloc(size);
     checkheap(1);
     old = (node*)((long)oldptr - WSIZE);
-    size = (size + 7) & ~7;
+    checkblock(old);
+    size = adjust_size(size);
     if(block_size(old) == size)
         return oldptr;
 
+    clock_ops++;
     oldsize = block_size(old);
-    prev = block_prev(old);
+    prev = prev_free(old) ? block_prev(old) : NULL;
     next = block_next(old);
     if(block_free(next)){
-        if(block_free(prev)){
+        if(prev){
             if( (newsz = get_combined_size3(prev, old, next)) >= size){
+                stat_free(old);
+                class_stats(old)->coalesces += 2;
                 delete(prev);
                 delete(next);
-                prev->head = newsz | (prev->head & (PFIXED|SZCLASS));
+                block_unmark(prev);
+                block_unmark(old);
+                block_unmark(next);
+                prev->head = newsz | (prev->head & PREV_ALLOC);
             }
             else{
-                return relocate(oldptr, oldsize, size);
+                return relocate(oldptr, oldsize + WSIZE, size + WSIZE);
             }
         }
         else if((newsz = get_combined_size2(old, next)) >= size){
+            stat_free(old);
+            class_stats(old)->coalesces++;
             delete(next);
-            old->head = newsz | (old->head & (PFIXED|SZCLASS));
+            block_unmark(old);
+            block_unmark(next);
+            old->head = newsz | (old->head & PREV_ALLOC);
             old->head |= ALLOC;
             block_mark(old);
+            stat_alloc(old, 1);
+            checkblock(old);
             return &old->prev;
         }
-        else return relocate(oldptr, oldsize, size);
+        else return relocate(oldptr, oldsize + WSIZE, size + WSIZE);
     }
-    else if(block_free(prev)){
+    else if(prev){
         if((newsz = get_combined_size2(prev, old)) >= size){
+            stat_free(old);
+            class_stats(old)->coalesces++;
             delete(prev);
-            prev->head = newsz | (prev->head & (PFIXED|SZCLASS));
+            block_unmark(prev);
+            block_unmark(old);
+            prev->head = newsz | (prev->head & PREV_ALLOC);
         }
-        else return relocate(oldptr, oldsize, size);
-    } else return relocate(oldptr, oldsize, size);
+        else return relocate(oldptr, oldsize + WSIZE, size + WSIZE);
+    } else return relocate(oldptr, oldsize + WSIZE, size + WSIZE);
     prev->head |= ALLOC;
     block_mark(prev);
+    stat_alloc(prev, 1);
     oldsize = size < oldsize ? size : oldsize;
     newptr = (void*)&prev->prev;
-    memcpy(newptr, oldptr, oldsize);
+    //the blocks overlap when merging backwards
+    mm_move(newptr, oldptr, oldsize + WSIZE);
+    checkblock(prev);
     checkheap(1);
     return newptr;
 }
 
 /* Perform realloc by malloc-ing a new pointer and copying the
  * contents of the old pointer to the new location before returning
- * the new pointer.
+ * the new pointer. Sizes are the usable payload sizes of the blocks,
+ * including the 4 bytes where a free block would keep its footer.
  */
 void* relocate(void* oldptr, size_t oldsize, size_t size){
     void* newptr = malloc(size);
+    if(newptr == NULL)
+        return NULL;
     //copy first oldSize bytes of oldptr to newptr
     oldsize = size < oldsize ? size : oldsize;
-    memcpy(newptr,oldptr, oldsize);
+    mm_copy(newptr, oldptr, oldsize);
     free(oldptr);
     checkheap(1);
     return newptr;
@@ -673,64 +1746,1628 @@ void* relocate(void* oldptr, size_t oldsize, size_t size){
  */
 void *calloc (size_t nmemb, size_t size) {
     void* newptr;
+    if(size && nmemb > LIMIT / size){
+        errno = ENOMEM;
+        return NULL;
+    }
+    lock();
     checkheap(1);
     newptr = malloc(nmemb * size);
-    memset(newptr, 0, nmemb * size);
+    if(newptr)
+        mm_zero(newptr, nmemb * size);
     checkheap(1);
+    unlock();
     return newptr;
 }
 
-// Returns 0 if no errors were found, otherwise returns the error
-int mm_checkheap(int verbose) {
-    node *p, **listptr;
-    int count = 0, r;
-    size_t offset = 0;
-    char class;
-    p = prolog;
-    while(p != epilog){
-        if(!aligned((uint32_t*)p+1)){
-            if(verbose) fprintf(stderr,"block not aligned\n");
-            fprintf(stderr,"p:%p\n",(void*)(p));
-            fprintf(stderr,"prolog+%zd\n",offset);
-            printheap();
-            return 1;
+/* Allocates size bytes aligned to alignment, a power of two. Allocates
+ * enough to find an aligned payload at least 16 bytes into the block, so
+ * that the bytes before it can be freed as a block of their own, and
+ * frees what is left after it the same way.
+ */
+void *mm_memalign(size_t alignment, size_t size){
+    node *n, *m, *t;
+    size_t total, gap;
+    char* p;
+    if(alignment & (alignment - 1)){
+        errno = EINVAL;
+        return NULL;
+    }
+    if(oversized(size) || oversized(alignment))
+        return NULL;
+    if(alignment <= DSIZE)
+        return malloc(size);
+    lock();
+    size = adjust_size(size);
+    p = place(size + alignment + 2*DSIZE, NO_HINT);
+    if(p == NULL){
+        unlock();
+        return NULL;
+    }
+    n = (node*)(p - WSIZE);
+    total = block_size(n);
+    //the parts are counted instead, release counts them freed
+    stat_alloc(n, -1);
+    m = (node*)((char*)align(p + 2*DSIZE, alignment) - WSIZE);
+    gap = (char*)m - (char*)n;
+    block_unmark(n);
+    n->head = (gap - DSIZE) | (n->head & METAMASK);
+    m->head = (total - gap) | ALLOC | PREV_ALLOC;
+    block_mark(n);
+    block_mark(m);
+    if(total - gap - size >= 2*DSIZE){
+        block_unmark(m);
+        m->head = size | ALLOC | PREV_ALLOC;
+        block_mark(m);
+        t = block_next(m);
+        t->head = (total - gap - size - DSIZE) | ALLOC | PREV_ALLOC;
+        block_mark(t);
+        stat_alloc(t, 1);
+        release(&t->prev);
+    }
+    stat_alloc(m, 1);
+    stat_alloc(n, 1);
+    release(&n->prev);
+    unlock();
+    return &m->prev;
+}
+
+#ifndef DRIVER
+/*
+ *  Library Entry Points
+ *  --------------------
+ *  Built without DRIVER, mm.c replaces the C library's allocator. The heap
+ *  is set up by the first call into the allocator, which may come from the
+ *  dynamic linker or libc before main runs. Calls are serialised by
+ *  heap_lock, which is held across fork so the child gets a consistent heap.
+ */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fork_prepare(void){
+    lock();
+}
+
+static void fork_release(void){
+    unlock();
+}
+
+/* Sets up the heap. mm_lock is set first, so allocations made while the
+ * heap is set up, such as by pthread_atfork, do not come back here.
+ * MM_PREFAULT=<KB> keeps that much of the heap above the brk faulted in,
+ * and MM_MLOCK=1 locks the heap in memory, see mem_prefault.
+ * MM_GUARD_RATE=<n> samples one in about every n allocations into guard
+ * pages, see mm_guard_start. MM_CHECK=<level>[,<blocks>[,<threads>]] sets
+ * how much of the heap is checked, see mm_set_check.
+ */
+static void boot(void){
+    const char* env;
+    char* end;
+    size_t ahead = 0;
+    int pin = 0, level;
+    unsigned int blocks = 0, threads = 0;
+    mm_lock = &heap_lock;
+    if((env = getenv("MM_PREFAULT")))
+        ahead = strtoul(env, NULL, 10) << 10;
+    if((env = getenv("MM_MLOCK")))
+        pin = *env == '1';
+    if(ahead || pin)
+        mem_prefault(ahead, pin);
+    mem_init();
+    mm_init();
+    if((env = getenv("MM_GUARD_RATE")))
+        mm_guard_setup(strtoul(env, NULL, 10), MM_GUARD_SLOTS);
+    if((env = getenv("MM_CHECK"))){
+        level = strtol(env, &end, 10);
+        if(*end == ',')
+            blocks = strtoul(end + 1, &end, 10);
+        if(*end == ',')
+            threads = strtoul(end + 1, &end, 10);
+        if(mm_set_check(level, blocks, threads) < 0)
+            fprintf(stderr, "mm: MM_CHECK needs a build with -DHEAP_CHECK\n");
+    }
+    if((env = getenv("MM_STATS")) &&
+       mm_stats_publish(strcmp(env, "1") ? env : NULL) < 0)
+        perror("mm: MM_STATS");
+    pthread_atfork(fork_prepare, fork_release, fork_release);
+}
+
+void *memalign(size_t alignment, size_t size){
+    return mm_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size){
+    return mm_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size){
+    void* p;
+    if(alignment < sizeof(void*) || (alignment & (alignment - 1)))
+        return EINVAL;
+    if((p = mm_memalign(alignment, size)) == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void *valloc(size_t size){
+    return mm_memalign(mem_pagesize(), size);
+}
+
+void *pvalloc(size_t size){
+    size_t page = mem_pagesize();
+    if(oversized(size))
+        return NULL;
+    return mm_memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+//libc's reallocarray would call its own realloc
+void *reallocarray(void *ptr, size_t nmemb, size_t size){
+    if(size && nmemb > LIMIT / size){
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+/* An allocated block has no footer, so its last 4 bytes are usable too.
+ */
+size_t malloc_usable_size(void *ptr){
+    if(mm_guard_owns(ptr))
+        return mm_guard_size(ptr);
+    return ptr ? block_size((node*)((char*)ptr - WSIZE)) + WSIZE : 0;
+}
+#else
+//malloc_usable_size for the driver
+size_t mm_usable_size(void *ptr){
+    if(mm_guard_owns(ptr))
+        return mm_guard_size(ptr);
+    return ptr ? block_size((node*)((char*)ptr - WSIZE)) + WSIZE : 0;
+}
+#endif
+
+/*
+ *  Movable Allocations
+ *  -------------------
+ *  Blocks allocated through mm_halloc are only reached through a handle,
+ *  so mm_compact may slide them towards the bottom of the heap while they
+ *  are not pinned. Their headers have MOVABLE set and the first word of
+ *  their payload holds their handle, the user's data starts DSIZE bytes
+ *  into the payload to stay 8 byte aligned.
+ */
+
+//gets the block a handle refers to
+static inline node* handle_block(uint32_t h){
+    return mm_off_to_ptr(htable[h].off);
+}
+
+/* Allocates a movable block of size bytes and returns a handle to it,
+ * or 0 if there is no room. Handle 0 is never used.
+ */
+unsigned int mm_halloc(size_t size){
+    unsigned int h;
+    if(oversized(size))
+        return 0;
+    lock();
+    h = halloc(size);
+    unlock();
+    return h;
+}
+
+//does the work of mm_halloc
+static unsigned int halloc(size_t size){
+    uint32_t h;
+    node* n;
+    struct handle *t, *old;
+    if(!hfree){
+        //grow the handle table, entry 0 stays unused. The old table is
+        //freed once htable points at the new one, the checker reads it
+        h = hcap ? hcap : 1;
+        t = own_alloc(2 * h * sizeof(struct handle));
+        if(t == NULL)
+            return 0;
+        if(htable)
+            memcpy(t, htable, hcap * sizeof(struct handle));
+        old = htable;
+        htable = t;
+        release(old);
+        hcap = 2 * h;
+        for(; h < hcap; h++){
+            htable[h].off = hfree;
+            htable[h].pins = HANDLE_FREE;
+            hfree = h;
         }
-        if(block_next(p)){
-            if(block_prev(block_next(p)) != p){
-                fprintf(stderr,"Next adjacent blocks previous block isnt this block\n");
-                fprintf(stderr,"prolog+%zd\n",offset);
-                printheap();
-                return 1;
-            }
+    }
+    n = place(size + DSIZE, NO_HINT);
+    if(n == NULL)
+        return 0;
+    n = (node*)((long)n - WSIZE);
+    h = hfree;
+    hfree = htable[h].off;
+    htable[h].off = heap_off(n);
+    htable[h].pins = 0;
+    n->head |= MOVABLE;
+    n->prev = h;
+    return h;
+}
+
+/* Returns the address of a handle's data. It stays valid until the next
+ * call to mm_compact unless the handle is pinned.
+ */
+void* mm_hderef(unsigned int h){
+    void* p;
+    lock();
+    p = (char*)handle_block(h) + WSIZE + DSIZE;
+    unlock();
+    return p;
+}
+
+//pins a handle so mm_compact leaves it where it is, returns its data
+void* mm_hpin(unsigned int h){
+    void* p;
+    lock();
+    htable[h].pins++;
+    p = mm_hderef(h);
+    unlock();
+    return p;
+}
+
+//undoes one call to mm_hpin
+void mm_hunpin(unsigned int h){
+    lock();
+    REQUIRES(htable[h].pins > 0);
+    htable[h].pins--;
+    unlock();
+}
+
+//frees a handle and the block it refers to
+void mm_hfree(unsigned int h){
+    node* n;
+    if(h == 0)
+        return;
+    lock();
+    n = handle_block(h);
+    n->head &= ~MOVABLE;
+    release(&n->prev);
+    htable[h].off = hfree;
+    htable[h].pins = HANDLE_FREE;
+    hfree = h;
+    unlock();
+}
+
+/* Slides the movable block h down into the free block f just before it.
+ * The free space ends up after h where it is coalesced with the next block
+ * if that is free. Returns the new free block.
+ */
+static node* slide(node* f, node* h){
+    node *next = block_next(h), *g;
+    size_t hsize = block_size(h), fsize = block_size(f) + DSIZE;
+    uint32_t id = h->prev;
+    delete(f);
+    block_unmark(f);
+    block_unmark(h);
+    if(block_free(next)){
+        delete(next);
+        block_unmark(next);
+        fsize += block_size(next) + DSIZE;
+    }
+    //f's header does not overlap h's payload
+    f->head = hsize | (f->head & PREV_ALLOC) | ALLOC | MOVABLE;
+    mm_move(&f->prev, &h->prev, hsize + WSIZE);
+    block_mark(f);
+    htable[id].off = heap_off(f);
+    g = block_next(f);
+    g->head = (fsize - DSIZE) | PREV_ALLOC;
+    block_mark(g);
+    add(g);
+    return g;
+}
+
+/* Gives a free block at the end of the heap back to the memory system,
+ * keeping the first keep bytes of it as a free block. Returns the number
+ * of bytes given back.
+ */
+static size_t trim(size_t keep){
+    node* f;
+    size_t size;
+    if(!prev_free(epilog))
+        return 0;
+    f = block_prev(epilog);
+    size = block_size(f) + DSIZE;
+    if(size <= keep)
+        return 0;
+    //the smallest free block is 16 bytes
+    keep = keep < 2*DSIZE ? 0 : keep & ~(size_t)METAMASK;
+    delete(f);
+    block_unmark(f);
+    block_unmark(epilog);
+    if(keep){
+        f->head = (keep - DSIZE) | (f->head & PREV_ALLOC);
+        epilog = block_next(f);
+        epilog->head = ALLOC;
+        block_mark(f);
+        add(f);
+    } else {
+        f->head = ALLOC | (f->head & PREV_ALLOC);
+        epilog = f;
+    }
+    block_mark(epilog);
+    mem_sbrk(-(intptr_t)(size - keep));
+    if(stats_page)
+        stats_store();
+    return size - keep;
+}
+
+/* One incremental step of compaction. Moves unpinned movable blocks down
+ * into the free block before them until about budget bytes have been
+ * moved, then trims the free tail of the heap. Continues where the last
+ * step stopped as long as nothing was allocated or freed in between.
+ * Returns the number of bytes moved.
+ */
+size_t mm_compact(size_t budget){
+    node *n, *m;
+    size_t moved = 0;
+    lock();
+    mm_quick_flush();
+    checkheap(1);
+    n = (hcursor && hcursor_clock == clock_ops) ? hcursor : prolog;
+    while(n != epilog && moved < budget){
+        m = block_next(n);
+        if(block_free(n) && (m->head & MOVABLE) && !htable[m->prev].pins){
+            moved += block_size(m);
+            n = slide(n, m);
         }
-        if(block_prev(p)){
-            if(block_next(block_prev(p)) != p){
-                fprintf(stderr,"prev adjacent blocks next block isnt this block\n");
-                fprintf(stderr,"prolog+%zd\n",offset);
-                printheap();
-                return 1;
-            }
+        else n = m;
+    }
+    hcursor = n == epilog ? NULL : n;
+    hcursor_clock = clock_ops;
+    //blocks moved without a malloc or free, clock_ops does not tell
+    pcursor = NULL;
+    trim(0);
+    if(hcursor && hcursor == epilog)
+        hcursor = NULL;
+    checkheap(1);
+    unlock();
+    return moved;
+}
+
+/*
+ *  Persistent and Shared Heaps
+ *  ---------------------------
+ *  mm_open_persistent maps the heap from a file copy on write, so the file
+ *  only changes when mm_sync_persistent replaces it with the whole heap,
+ *  see mem_sync. If the process dies, or the machine, the file holds the
+ *  heap as of the last sync that finished. mm_set_root stores one pointer
+ *  in the superblock from which the application can find its data again.
+ *
+ *  mm_open_shared maps the heap so several processes can use it at once.
+ *  The superblock is then the control block: it holds the process shared
+ *  mutex and is kept current by every call, since each process keeps its
+ *  own copy of the free list heads and the brk between calls. The mutex is
+ *  robust, a process that dies holding it leaves the heap to the next one
+ *  to lock it, see lock_recover.
+ */
+
+//writes the allocator state into the superblock
+static void sb_store(void){
+    int i;
+    sb->size = mem_heapsize();
+    sb->htable = heap_off(htable);
+    sb->hcap = hcap;
+    sb->hfree = hfree;
+    for(i = 0; i < LISTBOUND; i++)
+        sb->lists[i] = heap_off(lists[i]);
+}
+
+/* Reads the allocator state back from the superblock, moving this
+ * process's brk to where the last writer left it.
+ */
+static void sb_load(void){
+    int i;
+    if(sb->size != mem_heapsize())
+        mem_sbrk((intptr_t)sb->size - (intptr_t)mem_heapsize());
+    epilog = (node*)((long)mem_heap_hi()-3);
+    for(i = 0; i < LISTBOUND; i++)
+        lists[i] = mm_off_to_ptr(sb->lists[i]);
+    htable = mm_off_to_ptr(sb->htable);
+    hcap = sb->hcap;
+    hfree = sb->hfree;
+    //other processes may have changed the heap since the last step
+    hcursor = NULL;
+    roll = NULL;
+}
+
+/* Puts every free block of the heap back on the free lists, walking the
+ * heap by its headers. Adjacent free blocks are merged, and the boundary
+ * tags and the epilog are written again. Returns -1 if the headers do not
+ * lead from the prolog to the epilog.
+ */
+static int lists_rebuild(void){
+    node *n, *m, *run = NULL;
+    int i;
+    for(i = 0; i < LISTBOUND; i++){
+        lists[i] = NULL;
+        heap_stats.classes[i].free_blocks = heap_stats.classes[i].free_bytes = 0;
+    }
+    for(n = prolog; n != epilog; n = m){
+        m = (node*)((long)n + block_size(n) + DSIZE);
+        if(m <= n || m > epilog)
+            return -1;
+        if(block_free(n)){
+            if(run == NULL)
+                run = n;
+            if(m != epilog && block_free(m))
+                continue;
+            run->head = ((char*)m - (char*)run - DSIZE) | PREV_ALLOC;
+            block_mark(run);
+            add(run);
+            run = NULL;
+        } else
+            block_mark(n);
+    }
+    epilog->head = ALLOC | (epilog->head & PREV_ALLOC);
+    return 0;
+}
+
+/* Called by lock when the process that held a shared heap's lock died.
+ * The superblock is as that process last unlocked it, the heap as it left
+ * it, so the free lists are rebuilt from the headers before the heap is
+ * checked and the lock made consistent. Blocks the process allocated stay
+ * allocated. If the heap is still not sound the process aborts, leaving
+ * the lock to the next one, which does the same.
+ */
+static void lock_recover(void){
+    sb_load();
+    if(lists_rebuild() < 0 || check_heap(0)){
+        fprintf(stderr, "mm: a process died holding the shared heap's lock "
+                "and left the heap corrupt\n");
+        abort();
+    }
+    sb_store();
+    pthread_mutex_consistent(mm_lock);
+}
+
+/* Writes the allocator state into the superblock and the heap into the
+ * file, under the lock so no other thread changes it halfway. Returns 0
+ * on success and -1 on error, when the file still holds the heap as of
+ * the last successful call.
+ */
+int mm_sync_persistent(void){
+    int r;
+    if(sb == NULL)
+        return 0;
+    lock();
+    sb_store();
+    r = mem_sync();
+    unlock();
+    return r;
+}
+
+/* Maps the heap in the file at path, or an anonymous shared mapping if
+ * path is NULL, and creates an empty heap in it if there is none.
+ * Returns 0 on success and -1 on error.
+ */
+static int open_heap(const char* path, char share){
+    pthread_mutexattr_t attr;
+    if(mem_init_file(path, share) < 0)
+        return -1;
+    sb = mem_heap_lo();
+    if(sb->magic != SUPER_MAGIC){
+        if(mem_sbrk(SUPERSIZE) == (void*)-1 || mm_init() < 0)
+            goto fail;
+        sb->root = 0;
+        sb->prolog = heap_off(prolog);
+        sb->shared = share;
+        if(share){
+            pthread_mutexattr_init(&attr);
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+            pthread_mutex_init(&sb->lock, &attr);
+            pthread_mutexattr_destroy(&attr);
         }
-        if(block_free(p))
-            count++;
-        p = block_next(p);
-        offset++;
+        sb_store();
+        sb->magic = SUPER_MAGIC;
+    } else {
+        if(sb->shared != (uint32_t)share){
+            fprintf(stderr, "heap was not created with the same mode\n");
+            goto fail;
+        }
+        lbound = mem_heap_lo();
+        prolog = mm_off_to_ptr(sb->prolog);
+        clock_ops = 0;
+        memset(last_free, 0, sizeof(last_free));
+        policy_reset();
+        sb_load();
+#ifdef SIZE_INDEX
+        if(!share)
+            index_rebuild();
+#endif
+#ifdef BITMAP_TAGS
+        //the bitmaps are not part of the file, rebuild them from the headers
+        node* n;
+        bm_clear_range(granule(prolog), granule(epilog));
+        for(n = prolog; n != epilog; n = block_next(n))
+            block_mark(n);
+        block_mark(epilog);
+#endif
+    }
+    if(share){
+        mm_lock = &sb->lock;
+        shared = 1;
+    }
+    checkheap(1);
+    return 0;
+fail:
+    sb = NULL;
+    mem_deinit();
+    return -1;
+}
+
+/* Opens the heap stored in the file at path, creating an empty heap if the
+ * file is new. Returns 0 on success and -1 on error.
+ */
+int mm_open_persistent(const char* path){
+    return path ? open_heap(path, 0) : -1;
+}
+
+/* Opens a heap shared with other processes, either through the file at
+ * path, normally under /dev/shm, or if path is NULL through an anonymous
+ * mapping that is shared with children forked afterwards. The first
+ * process creates the heap and must be done before others open it.
+ * Returns 0 on success and -1 on error.
+ */
+int mm_open_shared(const char* path){
+#ifdef BITMAP_TAGS
+    //the side bitmaps are private to a process
+    (void)path;
+    return -1;
+#else
+    return open_heap(path, 1);
+#endif
+}
+
+//syncs and unmaps a persistent or shared heap
+void mm_close_persistent(void){
+    if(sb == NULL)
+        return;
+    mm_quick_flush();
+    mm_sync_persistent();
+    mm_lock = NULL;
+    shared = 0;
+    sb = NULL;
+    mem_deinit();
+}
+
+//sets the pointer returned by mm_get_root
+void mm_set_root(void* p){
+    REQUIRES(sb != NULL);
+    lock();
+    sb->root = heap_off(p);
+    unlock();
+}
+
+//gets the pointer stored by mm_set_root, NULL if there is none
+void* mm_get_root(void){
+    return sb ? mm_off_to_ptr(sb->root) : NULL;
+}
+
+/*
+ *  Quicklists
+ *  ----------
+ *  The inline mm_malloc_fast and mm_free_sized in mm.h keep small blocks
+ *  on per thread lists by block size, without going through the free
+ *  lists. Cached blocks stay allocated as far as the heap is concerned,
+ *  they are only coalesced once mm_quick_flush gives them back.
+ */
+__thread struct mm_quick mm_quick;
+
+/* A thread's quicklists join quick_threads on its first refill, and are
+ * flushed and leave it by the destructor of quick_key when it exits. The
+ * list is guarded by mm_lock.
+ *
+ * mm_maint_step empties the quicklists of threads whose gen shows they
+ * have not refilled since the last step. The thread itself pushes and pops
+ * without the lock, so quick_drain sets drain on their lists, then makes
+ * every thread of the process execute a memory barrier with membarrier.
+ * Afterwards a thread either sees drain and goes to mm_quick_refill or
+ * free, which wait for mm_lock, or it was already using its lists and
+ * busy shows it, and those lists are left for the next step. Without
+ * membarrier no lists are emptied.
+ */
+static pthread_key_t quick_key;
+static pthread_once_t quick_once = PTHREAD_ONCE_INIT;
+static unsigned long quick_gen = 1;
+static int quick_barrier;   //membarrier command, 0 if there is none
+
+static void quick_exit(void* q){
+    struct mm_quick** t;
+    lock();
+    mm_quick_flush();
+    for(t = &quick_threads; *t; t = &(*t)->next){
+        if(*t == q){
+            *t = (*t)->next;
+            break;
+        }
+    }
+    unlock();
+}
+
+static void quick_key_init(void){
+    pthread_key_create(&quick_key, quick_exit);
+    if(syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0)
+        quick_barrier = MEMBARRIER_CMD_PRIVATE_EXPEDITED;
+    else if(syscall(SYS_membarrier, MEMBARRIER_CMD_QUERY, 0) > 0)
+        quick_barrier = MEMBARRIER_CMD_GLOBAL;
+}
+
+/* Called by mm_malloc_fast when the quicklist of class c is empty, or is
+ * being drained. Takes MM_QUICK_BATCH blocks from the heap under one lock,
+ * returns one and keeps the rest.
+ */
+void* mm_quick_refill(unsigned int c){
+    void *first, *p;
+    int i;
+    if(mm_quick.gen == 0){
+        pthread_once(&quick_once, quick_key_init);
+        pthread_setspecific(quick_key, &mm_quick);
+    }
+    lock();
+    if(mm_quick.gen == 0){
+        mm_quick.next = quick_threads;
+        quick_threads = &mm_quick;
+    }
+    mm_quick.gen = quick_gen;
+    first = place((c + 1) * DSIZE, DEFAULT_HINT);
+    for(i = 1; first && i < MM_QUICK_BATCH; i++){
+        if((p = place((c + 1) * DSIZE, DEFAULT_HINT)) == NULL)
+            break;
+        *(void**)p = mm_quick.head[c];
+        mm_quick.head[c] = p;
+        mm_quick.count[c]++;
     }
+    unlock();
+    return first;
+}
+
+//frees every block on q, returns how many there were
+static size_t quick_empty(struct mm_quick* q){
+    size_t n = 0;
+    void* p;
+    int c;
+    for(c = 0; c < MM_QUICK_CLASSES; c++){
+        while((p = q->head[c])){
+            q->head[c] = *(void**)p;
+            release(p);
+            n++;
+        }
+        q->count[c] = 0;
+    }
+    return n;
+}
+
+//frees every block on the calling thread's quicklists
+void mm_quick_flush(void){
+    lock();
+    quick_empty(&mm_quick);
+    unlock();
+}
+
+/* Empties the quicklists of the threads that did not refill one since the
+ * last call, see quick_threads. Returns the number of blocks freed.
+ */
+static size_t quick_drain(void){
+    struct mm_quick* q;
+    size_t n = 0;
+    int idle = 0, fenced;
+    lock();
+    for(q = quick_threads; quick_barrier && q; q = q->next){
+        if(q->gen != quick_gen){
+            __atomic_store_n(&q->drain, 1, __ATOMIC_RELAXED);
+            idle++;
+        }
+    }
+    quick_gen++;
+    unlock();
+    if(idle == 0)
+        return 0;
+    //every thread sees drain from its next use of its lists on
+    fenced = syscall(SYS_membarrier, quick_barrier, 0) == 0;
+    lock();
+    for(q = quick_threads; q; q = q->next){
+        if(!q->drain)
+            continue;
+        if(fenced && !__atomic_load_n(&q->busy, __ATOMIC_ACQUIRE))
+            n += quick_empty(q);
+        __atomic_store_n(&q->drain, 0, __ATOMIC_RELEASE);
+    }
+    unlock();
+    return n;
+}
+
+/*
+ *  Background Maintenance
+ *  ----------------------
+ *  mm_maint_step does the housekeeping malloc and free leave alone. It
+ *  empties the quicklists of idle threads so the blocks can be
+ *  coalesced, gives the whole pages inside large free blocks back to the
+ *  OS with madvise, and returns free space at the end of the heap above
+ *  trim_keep bytes to the memory system. If mem_prefault is on, it also
+ *  faults in the pages the heap grows into next, so malloc does not have
+ *  to. mm_maint_start calls it every interval_ms from a thread of its own.
+ *
+ *  A step holds the lock for a bounded amount of work: it looks at no
+ *  more than MAINT_VISITS blocks on the large free list and purges at
+ *  most purge_budget bytes, continuing where the last step stopped if the
+ *  heap did not change in between. Purged blocks are marked so they are
+ *  skipped until they are allocated or coalesced. A thread that uses its
+ *  quicklists keeps them, see quick_threads. Persistent and shared heaps
+ *  are not purged.
+ */
+#define MAINT_VISITS 256
+
+static struct mm_maint_config maint_conf = {100, 1 << 20, 64 << 10, 1 << 20};
+static struct mm_maint_stats maint_totals;
+//guards maint_conf and the thread's state
+static pthread_mutex_t maint_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t maint_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t maint_thread;
+static char maint_running;
+//driver builds do not lock until the maintenance thread needs it to
+static pthread_mutex_t maint_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Gives back the pages inside the payload of the free block n, except
+ * for the free list words at its start and the footer at its end.
+ * Returns the number of bytes given back.
+ */
+static size_t purge(node* n){
+    uintptr_t page = mem_pagesize();
+    uintptr_t lo = ((uintptr_t)(n + 1) + WSIZE + page - 1) & ~(page - 1);
+    uintptr_t hi = ((uintptr_t)block_next(n) - WSIZE) & ~(page - 1);
+    n->head |= PURGED;
+    if(hi <= lo || madvise((void*)lo, hi - lo, MADV_DONTNEED) < 0)
+        return 0;
+    return hi - lo;
+}
+
+//one round of maintenance, see above
+void mm_maint_step(void){
+    struct mm_maint_config conf;
+    node *n, *head;
+    size_t purged = 0, trimmed, drained;
+    int visits;
+    pthread_mutex_lock(&maint_mutex);
+    conf = maint_conf;
+    pthread_mutex_unlock(&maint_mutex);
+    drained = quick_drain();
+    lock();
+    head = get_list(SIZEN);
+    n = (pcursor && pcursor_clock == clock_ops) ? pcursor : head;
+    for(visits = 0; sb == NULL && n && visits < MAINT_VISITS; visits++){
+        if(purged >= conf.purge_budget)
+            break;
+        if(!(n->head & PURGED) && block_size(n) >= conf.purge_min)
+            purged += purge(n);
+        n = next(n);
+        if(n == head)
+            n = NULL;
+    }
+    pcursor = n;
+    pcursor_clock = clock_ops;
+    if((trimmed = trim(conf.trim_keep)))
+        pcursor = NULL;
+    mem_populate();
+    maint_totals.steps++;
+    maint_totals.purged += purged;
+    maint_totals.trimmed += trimmed;
+    maint_totals.drained += drained;
+    if(stats_page)
+        stats_store();
+    checkheap(1);
+    unlock();
+}
+
+static void* maint_main(void* arg){
+    struct timespec t;
+    long ms;
+    (void)arg;
+    pthread_mutex_lock(&maint_mutex);
+    while(maint_running){
+        ms = maint_conf.interval_ms ? maint_conf.interval_ms : 1;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += ms / 1000;
+        t.tv_nsec += ms % 1000 * 1000000;
+        if(t.tv_nsec >= 1000000000){
+            t.tv_sec++;
+            t.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&maint_cond, &maint_mutex, &t);
+        if(!maint_running)
+            break;
+        pthread_mutex_unlock(&maint_mutex);
+        mm_maint_step();
+        pthread_mutex_lock(&maint_mutex);
+    }
+    pthread_mutex_unlock(&maint_mutex);
+    return NULL;
+}
+
+/* Starts the maintenance thread, or changes its settings if it is already
+ * running. conf may be NULL for the defaults. If the heap is not locked
+ * yet, as in driver builds, this turns locking on, so it has to be called
+ * before other threads use the heap. Returns 0 on success and -1 if the
+ * thread could not be created.
+ */
+int mm_maint_start(const struct mm_maint_config* conf){
+    int r = 0;
+    //sets up the library's heap and lock if this is the first call
+    lock();
+    unlock();
+    if(mm_lock == NULL)
+        mm_lock = &maint_heap_lock;
+    pthread_mutex_lock(&maint_mutex);
+    if(conf)
+        maint_conf = *conf;
+    if(!maint_running){
+        maint_running = 1;
+        if(pthread_create(&maint_thread, NULL, maint_main, NULL)){
+            maint_running = 0;
+            r = -1;
+        }
+    }
+    pthread_mutex_unlock(&maint_mutex);
+    return r;
+}
+
+//stops the maintenance thread and waits for it to finish its step
+void mm_maint_stop(void){
+    pthread_mutex_lock(&maint_mutex);
+    if(!maint_running){
+        pthread_mutex_unlock(&maint_mutex);
+        return;
+    }
+    maint_running = 0;
+    pthread_cond_signal(&maint_cond);
+    pthread_mutex_unlock(&maint_mutex);
+    pthread_join(maint_thread, NULL);
+}
+
+//totals over all steps since the program started
+void mm_maint_stats(struct mm_maint_stats* stats){
+    lock();
+    *stats = maint_totals;
+    unlock();
+}
+
+/*
+ *  Sampled Guard Pages
+ *  -------------------
+ *  malloc hands one in about every rate allocations to mmguard.c, which
+ *  puts the block in front of an inaccessible page. free, realloc and
+ *  malloc_usable_size recognize those blocks by their address. Persistent
+ *  and shared heaps are not sampled, their blocks have to be in the heap.
+ */
+
+//see mm.h
+int mm_guard_start(unsigned int rate, unsigned int slots){
+    int r;
+    lock();
+    r = mm_guard_setup(rate, slots ? slots : MM_GUARD_SLOTS);
+    unlock();
+    return r;
+}
+
+void mm_guard_stats(struct mm_guard_stats* stats){
+    lock();
+    mm_guard_counts(&stats->samples, &stats->live, &stats->slots);
+    unlock();
+}
+
+/*
+ *  Published Statistics
+ *  --------------------
+ *  Once mm_stats_publish mapped the page, heap_stats is copied to it every
+ *  STATS_EVERY calls to malloc and free, whenever the heap grows or
+ *  shrinks and on every maintenance step, so the malloc and free paths
+ *  only pay for a test of clock_ops. mmstat reads the page while it is
+ *  copied, the words are stored with relaxed atomics so each one it reads
+ *  is a value the counter had, and the page lags the heap by at most
+ *  STATS_EVERY calls while the process allocates.
+ */
+
+static char stats_path[256];
+
+//copies what mm_get_stats would report to the page
+static void stats_store(void){
+    struct mm_stats st;
+    const unsigned long* from = (const unsigned long*)&st;
+    unsigned long* to = (unsigned long*)&stats_page->stats;
+    size_t i;
+    stats_collect(&st);
+    for(i = 0; i < sizeof(st) / sizeof(unsigned long); i++)
+        __atomic_store_n(&to[i], from[i], __ATOMIC_RELAXED);
+}
+
+//removes the file at exit, unless the process is a child that inherited it
+static void stats_unlink(void){
+    if(stats_page && stats_page->pid == (unsigned int)getpid())
+        unlink(stats_path);
+}
+
+//a child made by fork keeps its counters to itself
+static void stats_fork_child(void){
+    if(stats_page == NULL)
+        return;
+    munmap(stats_page, sizeof(*stats_page));
+    stats_page = NULL;
+}
+
+//see mm.h
+int mm_stats_publish(const char* path){
+    struct mm_stats_page* page;
+    int fd, n;
+    lock();
+    if(stats_page){
+        unlock();
+        return 0;
+    }
+    if(path)
+        n = snprintf(stats_path, sizeof(stats_path), "%s", path);
+    else
+        n = snprintf(stats_path, sizeof(stats_path), "/dev/shm/mmstat.%d",
+                     (int)getpid());
+    if(n < 0 || n >= (int)sizeof(stats_path)){
+        unlock();
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = open(stats_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        unlock();
+        return -1;
+    }
+    page = MAP_FAILED;
+    if(ftruncate(fd, sizeof(*page)) == 0)
+        page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0);
+    close(fd);
+    if(page == MAP_FAILED){
+        unlink(stats_path);
+        unlock();
+        return -1;
+    }
+    page->pid = getpid();
+    stats_page = page;
+    stats_store();
+    __atomic_store_n(&page->magic, MM_STATS_MAGIC, __ATOMIC_RELEASE);
+    atexit(stats_unlink);
+    pthread_atfork(NULL, NULL, stats_fork_child);
+    unlock();
+    return 0;
+}
+
+/*
+ *  Arenas
+ *  ------
+ *  An arena hands out memory by bumping a pointer through chunks it gets
+ *  from malloc, and gives all of it back at once by freeing the chunks.
+ *  Each chunk starts with the offset of the chunk allocated before it.
+ *  A request too large for a chunk gets a chunk of its own, which is
+ *  linked in behind the current chunk so bumping continues where it was.
+ *  An arena is not locked, only one thread may use it at a time.
+ */
+#define ARENA_CHUNK 8192
+
+struct mm_arena {
+    uint32_t chunk;     //newest chunk
+    uint32_t cur;       //next free byte of the current chunk
+    uint32_t end;       //end of the current chunk
+    unsigned int color; //of the next chunk, see CACHE_COLORS
+    struct mm_arena_stats stats;
+};
+
+/* Creates an arena whose chunks hold chunk_size bytes, or ARENA_CHUNK if
+ * chunk_size is 0. Returns NULL if there is no room.
+ */
+mm_arena* mm_arena_create(size_t chunk_size){
+    mm_arena* a;
+    if(oversized(chunk_size))
+        return NULL;
+    if((a = malloc(sizeof(mm_arena))) == NULL)
+        return NULL;
+    memset(a, 0, sizeof(mm_arena));
+    a->stats.chunk_size = chunk_size ? (chunk_size + DSIZE-1) & ~(DSIZE-1)
+                                     : ARENA_CHUNK;
+    return a;
+}
+
+//links a new chunk with room for size bytes into a, returns its data
+static char* arena_chunk(mm_arena* a, size_t size){
+    uint32_t* c = own_alloc(size + DSIZE);
+    if(c == NULL)
+        return NULL;
+    c[0] = a->chunk;
+    a->chunk = heap_off(c);
+    a->stats.chunks++;
+    a->stats.held += size + DSIZE;
+    if(a->stats.held > a->stats.peak_held)
+        a->stats.peak_held = a->stats.held;
+    return (char*)c + DSIZE;
+}
+
+/* Allocates size bytes from a. The memory lives until the arena is reset
+ * or destroyed, it can not be freed on its own. Returns NULL if there is
+ * no room, the statistics count the attempt anyway.
+ */
+void* mm_arena_alloc(mm_arena* a, size_t size){
+    char *p, *c;
+    uint32_t *big, *cur;
+    size_t skip = 0;
+    if(oversized(size))
+        return NULL;
+    size = size ? (size + DSIZE-1) & ~(DSIZE-1) : DSIZE;
+    a->stats.allocs++;
+    a->stats.used += size;
+    if(a->end - a->cur >= size){
+        p = mm_off_to_ptr(a->cur);
+        a->cur += size;
+        return p;
+    }
+    if(size > a->stats.chunk_size / 4 && a->chunk){
+        //keep bumping through the current chunk, put this one behind it
+        if((p = arena_chunk(a, size)) == NULL)
+            return NULL;
+        big = (uint32_t*)(p - DSIZE);
+        cur = mm_off_to_ptr(big[0]);
+        a->chunk = big[0];
+        big[0] = cur[0];
+        cur[0] = heap_off(big);
+        return p;
+    }
+    if(size > a->stats.chunk_size)
+        c = arena_chunk(a, size);
+    else
+        c = arena_chunk(a, a->stats.chunk_size + (skip = next_color(&a->color)));
+    if(c == NULL)
+        return NULL;
+    c += skip;
+    a->stats.wasted += a->end - a->cur + skip;
+    a->cur = heap_off(c) + size;
+    a->end = heap_off(c) + (size > a->stats.chunk_size ? size
+                                                      : a->stats.chunk_size);
+    return c;
+}
+
+/* Releases everything allocated from a by freeing its chunks, a stays
+ * usable. The cost depends on the number of chunks, not of allocations.
+ */
+void mm_arena_reset(mm_arena* a){
+    uint32_t* c;
+    a->stats.wasted += a->end - a->cur;
+    while(a->chunk){
+        c = mm_off_to_ptr(a->chunk);
+        a->chunk = c[0];
+        free(c);
+    }
+    a->cur = a->end = 0;
+    a->stats.held = 0;
+    a->stats.resets++;
+}
+
+//releases everything allocated from a and a itself
+void mm_arena_destroy(mm_arena* a){
+    if(a == NULL)
+        return;
+    mm_arena_reset(a);
+    free(a);
+}
+
+//copies a's statistics to stats
+void mm_arena_stats(const mm_arena* a, struct mm_arena_stats* stats){
+    *stats = a->stats;
+}
+
+/*
+ *  Pools
+ *  -----
+ *  A pool hands out objects of one size from slabs it gets from malloc.
+ *  mm_pool_get and mm_pool_put in mm.h only push and pop the pool's own
+ *  free list, which is linked through the first word of free objects.
+ *  Once enough objects are free mm_pool_trim looks for slabs whose
+ *  objects are all free and gives them back to the heap. A slab starts
+ *  with a pointer to the next slab and the number of bytes its objects are
+ *  moved up by for CACHE_COLORS, its objects follow aligned to the pool's
+ *  alignment.
+ */
+#define POOL_SLAB 16384
+#define POOL_MIN_OBJS 8
+
+//gets the first object of a slab
+static inline char* slab_objs(const mm_pool* p, void* slab){
+    return align((char*)slab + 2*sizeof(void*) + ((size_t*)slab)[1], p->align);
+}
+
+/* Creates a pool of objects of obj_size bytes aligned to align bytes, which
+ * must be a power of two. Returns NULL if there is no room.
+ */
+mm_pool* mm_pool_create(size_t obj_size, size_t align){
+    mm_pool* p;
+    REQUIRES(align && !(align & (align - 1)) && align <= 128);
+    if(oversized(obj_size))
+        return NULL;
+    p = malloc(sizeof(mm_pool));
+    if(p == NULL)
+        return NULL;
+    memset(p, 0, sizeof(mm_pool));
+    if(obj_size < sizeof(void*))
+        obj_size = sizeof(void*);
+    if(align < sizeof(void*))
+        align = sizeof(void*);
+    p->obj_size = (obj_size + align - 1) & ~(align - 1);
+    p->align = align;
+    p->per_slab = POOL_SLAB / p->obj_size;
+    if(p->per_slab < POOL_MIN_OBJS)
+        p->per_slab = POOL_MIN_OBJS;
+    p->trim_at = 2 * p->per_slab;
+    return p;
+}
+
+/* Sets the nfree at which mm_pool_put trims p: twice the free objects
+ * plus two slabs, so a trim, which walks the whole free list, costs a
+ * constant per put, but never more than the pool holds, so a pool whose
+ * objects are all free is always trimmed.
+ */
+static void pool_set_trim(mm_pool* p){
+    size_t cap = p->nslabs * p->per_slab;
+    p->trim_at = 2 * (p->nfree + p->per_slab);
+    if(cap && p->trim_at >= cap)
+        p->trim_at = cap - 1;
+}
+
+/* Called by mm_pool_get when the free list is empty. Adds a slab and
+ * returns one of its objects, or NULL if there is no room.
+ */
+void* mm_pool_refill(mm_pool* p){
+    void** slab;
+    char *o, *last;
+    size_t skip = next_color(&p->color);
+    slab = own_alloc(2*sizeof(void*) + skip + p->align - DSIZE + p->per_slab * p->obj_size);
+    if(slab == NULL)
+        return NULL;
+    slab[0] = p->slabs;
+    ((size_t*)slab)[1] = skip;
+    p->slabs = slab;
+    p->nslabs++;
+    o = slab_objs(p, slab);
+    last = o + (p->per_slab - 1) * p->obj_size;
+    //the first object is returned, the rest go on the free list
+    for(; last > o; last -= p->obj_size){
+        *(void**)last = p->head;
+        p->head = last;
+    }
+    p->nfree += p->per_slab - 1;
+    pool_set_trim(p);
+    return o;
+}
+
+static int slab_cmp(const void* a, const void* b){
+    const char *x = *(char* const*)a, *y = *(char* const*)b;
+    return x < y ? -1 : x > y;
+}
+
+//finds the index of the slab holding object o in the sorted array s
+static size_t slab_find(const mm_pool* p, char** s, size_t n, const char* o){
+    size_t lo = 0, hi = n, mid;
+    while(hi - lo > 1){
+        mid = (lo + hi) / 2;
+        if(slab_objs(p, s[mid]) <= o) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Gives every slab whose objects are all free back to the heap. Called by
+ * mm_pool_put when nfree passes trim_at, see pool_set_trim.
+ */
+void mm_pool_trim(mm_pool* p){
+    char **s, *o, **link;
+    void **slab, **tail;
+    size_t *count, i, n = p->nslabs;
+    pool_set_trim(p);
+    s = malloc(n * (sizeof(char*) + sizeof(size_t)));
+    if(s == NULL)
+        return;
+    count = (size_t*)(s + n);
+    for(i = 0, slab = p->slabs; slab; slab = *slab)
+        s[i++] = (char*)slab;
+    qsort(s, n, sizeof(char*), slab_cmp);
+    memset(count, 0, n * sizeof(size_t));
+    for(o = p->head; o; o = *(char**)o)
+        count[slab_find(p, s, n, o)]++;
+    //drop the objects of empty slabs from the free list
+    for(link = (char**)&p->head; *link; ){
+        if(count[slab_find(p, s, n, *link)] == p->per_slab)
+            *link = *(char**)*link;
+        else link = (char**)*link;
+    }
+    //unlink and free the empty slabs
+    tail = &p->slabs;
+    while((slab = *tail)){
+        if(count[slab_find(p, s, n, (char*)slab_objs(p, slab))] == p->per_slab){
+            *tail = *slab;
+            free(slab);
+            p->nslabs--;
+            p->nfree -= p->per_slab;
+        }
+        else tail = slab;
+    }
+    free(s);
+    pool_set_trim(p);
+}
+
+//frees every slab of p and p itself
+void mm_pool_destroy(mm_pool* p){
+    void **slab, **next;
+    if(p == NULL)
+        return;
+    for(slab = p->slabs; slab; slab = next){
+        next = *slab;
+        free(slab);
+    }
+    free(p);
+}
+
+/*
+ *  Heap Checking
+ *  -------------
+ *  block_error checks what can be seen of a block from its own header
+ *  and its neighbours, which is all MM_CHECK_LOCAL looks at. The rolling
+ *  check runs it over the next check_blocks blocks on each operation, so
+ *  the whole heap is covered every so many operations at a fixed cost per
+ *  operation. A block that is absorbed by its neighbour tells the rolling
+ *  check through check_forget, which then starts over at the prolog.
+ *
+ *  The full check walks the free lists first and then the heap. Every
+ *  free block on a list is known to start a block, so once the heap is
+ *  large enough the lowest free block above each of the addresses that
+ *  split it into check_threads equal parts starts a segment, and the
+ *  segments are walked in parallel. A walk that does not land on the start
+ *  of the next segment means the heap is corrupt.
+ *
+ *  The threads are started once by mm_set_check or mm_checkheap, before
+ *  they take mm_lock, because making a thread allocates. They then wait for
+ *  segments for the life of the process and never allocate or free, so
+ *  the heap stays still while it is walked. Until they are started, and in
+ *  a child after fork, the segments are walked one after the other.
+ */
+#define CHECK_THREADS_MAX 8
+//the fewest heap bytes worth a thread of their own
+#define CHECK_SEGMENT (256 << 10)
+
+//one part of the heap for the full check, and what it found there
+struct check_seg {
+    node *from, *to;
+    const node* bad;
+    const char* why;
+    size_t blocks;      //blocks before bad, or in the segment
+    int free_blocks;
+};
+
+/* The threads of the full check. check_workers of them wait on check_go
+ * until check_round changes, then thread i walks check_work[i] if i is
+ * below check_segs, and the last one to finish signals check_done. A new
+ * thread also signals check_done once it has counted itself in.
+ */
+static pthread_mutex_t check_start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t check_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t check_go = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t check_done = PTHREAD_COND_INITIALIZER;
+static struct check_seg* check_work;
+static unsigned int check_workers, check_segs, check_pending;
+static unsigned long check_round;
+static pid_t check_pid;
+
+/* What is wrong with block p that can be seen from p and its neighbours,
+ * or NULL if nothing is.
+ */
+static const char* block_error(const node* p){
+    const node* m;
+    if(!in_heap(p) || !aligned((uint32_t*)p+1))
+        return "block not aligned";
+    if(p == epilog)
+        return block_free(p) ? "epilog is free" : NULL;
+    m = block_next(p);
+    if(m > epilog)
+        return "block runs past the end of the heap";
+    if(block_free(p) == !prev_free(m))
+        return "Next adjacent blocks PREV_ALLOC doesnt match this block";
+    if(block_free(p)){
+        if(block_prev(m) != p)
+            return "Next adjacent blocks previous block isnt this block";
+        if(block_free(m))
+            return "adjacent free blocks were not coalesced";
+        if(!in_heap(next(p)) || !in_heap(prev(p)) ||
+                prev(next(p)) != p || next(prev(p)) != p)
+            return "free list links of this block are broken";
+    }
+    else if((p->head & MOVABLE) && handle_block(p->prev) != p)
+        return "movable block doesnt match its handle";
+    return NULL;
+}
+
+//walks one segment of the heap
+static void check_segment(struct check_seg* s){
+    node* p;
+    for(p = s->from; p != s->to; p = block_next(p)){
+        if(p > s->to)
+            s->why = "heap walk did not land on the start of the next segment";
+        else
+            s->why = block_error(p);
+        if(s->why){
+            s->bad = p;
+            return;
+        }
+        s->free_blocks += block_free(p);
+        s->blocks++;
+    }
+}
+
+//a thread of the full check, i is its segment
+static void* check_worker(void* arg){
+    unsigned int i = (uintptr_t)arg;
+    unsigned long seen;
+    pthread_mutex_lock(&check_mutex);
+    seen = check_round;
+    check_workers = i;
+    pthread_cond_broadcast(&check_done);
+    for(;;){
+        while(check_round == seen)
+            pthread_cond_wait(&check_go, &check_mutex);
+        seen = check_round;
+        if(i >= check_segs)
+            continue;
+        pthread_mutex_unlock(&check_mutex);
+        check_segment(&check_work[i]);
+        pthread_mutex_lock(&check_mutex);
+        if(--check_pending == 0)
+            pthread_cond_broadcast(&check_done);
+    }
+    return NULL;
+}
+
+/* Starts the threads of the full check up to check_threads, including the
+ * caller. Must not be called with mm_lock held.
+ */
+static void check_start(void){
+    pthread_t tid;
+    unsigned int n;
+    pthread_mutex_lock(&check_start_lock);
+    if(check_pid != getpid()){
+        //the threads did not survive a fork
+        pthread_mutex_init(&check_mutex, NULL);
+        pthread_cond_init(&check_go, NULL);
+        pthread_cond_init(&check_done, NULL);
+        check_workers = 0;
+        check_pid = getpid();
+    }
+    for(n = check_workers + 1; n < check_threads; n++){
+        if(pthread_create(&tid, NULL, check_worker, (void*)(uintptr_t)n))
+            break;
+        pthread_detach(tid);
+        pthread_mutex_lock(&check_mutex);
+        while(check_workers < n)
+            pthread_cond_wait(&check_done, &check_mutex);
+        pthread_mutex_unlock(&check_mutex);
+    }
+    pthread_mutex_unlock(&check_start_lock);
+}
+
+// Returns 0 if no errors were found, otherwise returns the error
+int mm_checkheap(int verbose) {
+    int r;
+    if(check_threads == 0)
+        mm_set_check(check_level, check_blocks, 0);
+    check_start();
+    lock();
+    r = check_heap(verbose);
+    unlock();
+    return r;
+}
+
+//does the work of mm_checkheap
+static int check_heap(int verbose) {
+    struct check_seg seg[CHECK_THREADS_MAX];
+    node *n, *start, **listptr;
+    int count = 0, segs, workers, i, k, r;
+    size_t offset = 0, span = (char*)epilog - (char*)prolog;
+    char class;
     for(class = 0; class < LISTBOUND; class++){
         listptr = get_list_addr(class);
+        k = count;
         r = check_flist(*listptr, class, &count);
         if(r){
             fprintf(stderr,"flist%d failed\n",class+4);
             printflist(class);
             return 1;
         }
+        if(sb == NULL &&
+           heap_stats.classes[(int)class].free_blocks != (size_t)(k - count)){
+            fprintf(stderr,"flist%d has %d blocks, mm_get_stats counts %zu\n",
+                    class+4, k - count, heap_stats.classes[(int)class].free_blocks);
+            return 1;
+        }
+    }
+
+    //the lowest free block in each part of the heap starts a segment
+    segs = span / CHECK_SEGMENT < check_threads ? span / CHECK_SEGMENT : check_threads;
+    memset(seg, 0, sizeof(seg));
+    seg[0].from = prolog;
+    for(class = 0; segs > 1 && class < LISTBOUND; class++){
+        start = n = get_list(class);
+        while(n){
+            k = ((char*)n - (char*)prolog) / (span / segs);
+            if(k > 0 && k < segs && (seg[k].from == NULL || n < seg[k].from))
+                seg[k].from = n;
+            n = next(n);
+            if(n == start)
+                break;
+        }
+    }
+    for(i = k = 1; i < segs; i++)
+        if(seg[i].from)
+            seg[k++].from = seg[i].from;
+    segs = segs > 1 ? k : 1;
+    for(i = 0; i < segs; i++)
+        seg[i].to = i + 1 < segs ? seg[i + 1].from : epilog;
+
+    workers = 0;
+    if(segs > 1 && check_pid == getpid()){
+        pthread_mutex_lock(&check_mutex);
+        workers = segs - 1 < (int)check_workers ? segs - 1 : (int)check_workers;
+        if(workers){
+            check_work = seg;
+            check_segs = segs;
+            check_pending = workers;
+            check_round++;
+            pthread_cond_broadcast(&check_go);
+        }
+        pthread_mutex_unlock(&check_mutex);
+    }
+    check_segment(&seg[0]);
+    for(i = workers + 1; i < segs; i++)
+        check_segment(&seg[i]);
+    if(workers){
+        pthread_mutex_lock(&check_mutex);
+        while(check_pending)
+            pthread_cond_wait(&check_done, &check_mutex);
+        pthread_mutex_unlock(&check_mutex);
+    }
+
+    for(i = 0; i < segs; i++){
+        if(seg[i].why){
+            fprintf(stderr,"%s\n",seg[i].why);
+            fprintf(stderr,"p:%p\n",(void*)seg[i].bad);
+            fprintf(stderr,"prolog+%zd\n",offset + seg[i].blocks);
+            if(verbose) printheap();
+            return 1;
+        }
+        offset += seg[i].blocks;
+        count += seg[i].free_blocks;
     }
     if(count){
         fprintf(stderr, "Uh oh %d free blocks in heap not on a list\n", count);
         return 1;
     }
+#ifdef SIZE_INDEX
+    for(class = SIZE11; class < LISTBOUND; class++){
+        if(check_index(class)){
+            fprintf(stderr,"index of flist%d failed\n",class+4);
+            printflist(class);
+            return 1;
+        }
+    }
+#endif
+    return 0;
+}
+
+#ifdef HEAP_CHECK
+/* Checks n and the blocks on either side of it, see block_error. Returns 0
+ * if nothing is wrong with them.
+ */
+static int check_block(const node* n){
+    const node* p = n;
+    const char* why = block_error(n);
+    if(why == NULL && n != epilog){
+        if((why = block_error(p = block_next(n))) == NULL && n != prolog && prev_free(n))
+            why = block_error(p = block_prev(n));
+    }
+    if(why){
+        fprintf(stderr,"%s\n",why);
+        fprintf(stderr,"p:%p\n",(void*)p);
+        return 1;
+    }
+    return 0;
+}
+
+/* The checks checkheap makes above MM_CHECK_LOCAL: the whole heap at
+ * MM_CHECK_FULL, otherwise the next check_blocks blocks once for each
+ * malloc, free and realloc. Returns 0 if nothing is wrong.
+ */
+static int check_step(int verbose){
+    node* p;
+    const char* why = NULL;
+    unsigned int i;
+    if(check_level >= MM_CHECK_FULL)
+        return check_heap(verbose);
+    if(roll_clock == clock_ops)
+        return 0;
+    roll_clock = clock_ops;
+    p = roll && roll < epilog ? roll : prolog;
+    for(i = 0; i < check_blocks && p != epilog; i++){
+        if((why = block_error(p)))
+            break;
+        p = block_next(p);
+    }
+    roll = p == epilog ? NULL : p;
+    if(why){
+        fprintf(stderr,"%s\n",why);
+        fprintf(stderr,"p:%p\n",(void*)p);
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+int mm_set_check(int level, unsigned int blocks, unsigned int threads){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    lock();
+    if(threads == 0)
+        threads = cpus > 0 ? cpus : 1;
+    check_threads = threads < CHECK_THREADS_MAX ? threads : CHECK_THREADS_MAX;
+    check_blocks = blocks ? blocks : MM_CHECK_BLOCKS;
+#ifdef HEAP_CHECK
+    check_level = level;
+    roll = NULL;
+#endif
+    unlock();
+    if(level >= MM_CHECK_FULL)
+        check_start();
+#ifdef HEAP_CHECK
+    return 0;
+#else
+    return level == MM_CHECK_OFF ? 0 : -1;
+#endif
+}
+
+#ifdef SIZE_INDEX
+//checks that the index of a class holds exactly the blocks on its list
+static int check_index(int class){
+    int i = class - SIZE11, len = 0;
+    uint32_t at;
+    node *n, *start;
+    if(shared || index_count[i] < 0)
+        return 0;
+    start = n = get_list(class);
+    while(n){
+        at = *index_slot(n);
+        if((int)at >= index_count[i] || index_off[i][at] != heap_off(n)){
+            fprintf(stderr,"free block is not at its place in the index\n");
+            return 1;
+        }
+        if(index_size[i][at] != block_size(n)){
+            fprintf(stderr,"index has the wrong size for a block\n");
+            return 1;
+        }
+        len++;
+        n = next(n);
+        if(n == start)
+            break;
+    }
+    if(len != index_count[i]){
+        fprintf(stderr,"index has %d entries for %d free blocks\n", index_count[i], len);
+        return 1;
+    }
     return 0;
 }
+#endif
 
 int check_flist(node* flist, char class, int* countptr){
     node* n, *start;
@@ -1,5 +1,9 @@
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #ifdef DRIVER
 
 /* declare functions for driver tests */
@@ -7,6 +11,7 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern size_t mm_usable_size(void *ptr);
 
 #else
 
@@ -15,11 +20,336 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *valloc(size_t size);
+extern void *pvalloc(size_t size);
+extern void *reallocarray(void *ptr, size_t nmemb, size_t size);
+extern size_t malloc_usable_size(void *ptr);
+
+#endif
 
+#ifdef DRIVER
+#define MM_MALLOC mm_malloc
+#define MM_FREE mm_free
+#else
+#define MM_MALLOC malloc
+#define MM_FREE free
 #endif
 
 extern int mm_init(void);
 
+/* Allocates size bytes aligned to alignment, which is a power of two. */
+extern void *mm_memalign(size_t alignment, size_t size);
+
+/* Lifetime hints for mm_malloc_hint. With MM_LIFETIME_AUTO the allocator
+   predicts the lifetime itself, mm_predict_lifetime tells what it would
+   predict for a request of size bytes. The hint only chooses the end of a
+   free block that has to be split: short lived blocks come from its high
+   end and long lived ones from its low end, so the two are kept apart
+   inside each free region, not in regions of their own. A block that fits
+   a free block exactly takes it where it is, and one that grows the heap
+   goes at its end. Over the traces with -DLIFETIME_AUTO, 69% of blocks
+   predicted short lived and 73% of those predicted long lived came from a
+   split block, 19% and 0.1% took a block whole, and 13% and 27% grew the
+   heap. */
+#define MM_LIFETIME_AUTO 0
+#define MM_SHORT_LIVED 1
+#define MM_LONG_LIVED 2
+extern void *mm_malloc_hint(size_t size, int hint);
+extern int mm_predict_lifetime(size_t size);
+
+/* Movable allocations. A handle's data may be moved by mm_compact unless
+   it is pinned, so only keep the address from mm_hderef until then. */
+extern unsigned int mm_halloc(size_t size);
+extern void *mm_hderef(unsigned int h);
+extern void *mm_hpin(unsigned int h);
+extern void mm_hunpin(unsigned int h);
+extern void mm_hfree(unsigned int h);
+extern size_t mm_compact(size_t budget);
+
+/* Compressed pointers. An allocated block's offset fits in 32 bits and
+   does not change while it is allocated, 0 stands for NULL. Blocks that
+   malloc sampled into guard pages (see mm_guard_start) have offsets too. */
+extern unsigned int mm_ptr_to_off(const void *ptr);
+extern void *mm_off_to_ptr(unsigned int off);
+
+/* Persistent heaps. The heap is kept in a file and survives the process
+   as of the last call to mm_sync_persistent that returned 0, which
+   writes the whole heap. Use mm_open_persistent instead of mm_init, the
+   root pointer leads back to the stored data. */
+extern int mm_open_persistent(const char *path);
+extern int mm_sync_persistent(void);
+extern void mm_close_persistent(void);
+extern void mm_set_root(void *ptr);
+extern void *mm_get_root(void);
+
+/* Shared heaps. Processes that open the same heap may free each other's
+   blocks. The heap can be mapped at a different address in each process,
+   so pass blocks between them as mm_ptr_to_off offsets. If a process dies
+   in the middle of a call, the next call in another process repairs the
+   free lists, or aborts if the heap can not be repaired. */
+extern int mm_open_shared(const char *path);
+
+/* Arenas. Allocations from an arena are only released all together by
+   mm_arena_reset or mm_arena_destroy. Counts are totals since creation. */
+typedef struct mm_arena mm_arena;
+struct mm_arena_stats {
+    size_t chunk_size;
+    size_t chunks;      /* chunks taken from the heap */
+    size_t allocs;
+    size_t used;        /* bytes handed out, rounded up to 8 */
+    size_t wasted;      /* bytes left unused at the end of chunks */
+    size_t held;        /* chunk bytes currently taken from the heap */
+    size_t peak_held;
+    size_t resets;
+};
+extern mm_arena *mm_arena_create(size_t chunk_size);
+extern void *mm_arena_alloc(mm_arena *a, size_t size);
+extern void mm_arena_reset(mm_arena *a);
+extern void mm_arena_destroy(mm_arena *a);
+extern void mm_arena_stats(const mm_arena *a, struct mm_arena_stats *stats);
+
+/* Pools of fixed size objects. mm_pool_get and mm_pool_put only touch the
+   pool's free list, slabs are added and given back to the heap out of
+   line. A pool is not locked, only one thread may use it at a time. */
+typedef struct mm_pool {
+    void *head;         /* free objects, linked through their first word */
+    size_t nfree;
+    size_t trim_at;     /* nfree at which mm_pool_put calls mm_pool_trim */
+    size_t obj_size;
+    size_t align;
+    size_t per_slab;    /* objects per slab */
+    void *slabs;
+    size_t nslabs;
+    unsigned int color; /* of the next slab, see CACHE_COLORS in mm.c */
+} mm_pool;
+extern mm_pool *mm_pool_create(size_t obj_size, size_t align);
+extern void *mm_pool_refill(mm_pool *p);
+extern void mm_pool_trim(mm_pool *p);
+extern void mm_pool_destroy(mm_pool *p);
+
+static inline void *mm_pool_get(mm_pool *p) {
+    void *o = p->head;
+    if (o == NULL)
+        return mm_pool_refill(p);
+    p->head = *(void **)o;
+    p->nfree--;
+    return o;
+}
+
+static inline void mm_pool_put(mm_pool *p, void *o) {
+    *(void **)o = p->head;
+    p->head = o;
+    if (++p->nfree > p->trim_at)
+        mm_pool_trim(p);
+}
+
+/* A pool for objects of the given type */
+#define mm_pool_of(type) mm_pool_create(sizeof(type), __alignof__(type))
+
+/* Quicklists. For a size known at compile time mm_malloc_fast pops a
+   block off the calling thread's quicklist for that size, and
+   mm_free_sized pushes it back, where size is the size it was allocated
+   with. Other sizes go to malloc and free. mm_quick_flush returns the
+   cached blocks to the heap. The lists are used without a lock, busy is
+   set around each use so mm_maint_step can tell when it may empty them,
+   see mm.c. */
+#define MM_QUICK_CLASSES 8
+#define MM_QUICK_MAX 64     /* largest size served from a quicklist */
+#define MM_QUICK_LIMIT 64   /* blocks kept per quicklist */
+#define MM_QUICK_BATCH 8    /* blocks taken from the heap per refill */
+#define MM_QUICK_CLASS(size) ((size) <= 4 ? 0 : (((size) + 3) >> 3) - 1)
+struct mm_quick {
+    void *head[MM_QUICK_CLASSES];
+    unsigned int count[MM_QUICK_CLASSES];
+    unsigned long gen;      /* maintenance step of the last refill, 0 before
+                               the first */
+    char busy;              /* set while the thread uses the lists */
+    char drain;             /* set while mm_maint_step may empty them */
+    struct mm_quick *next;  /* the lists of the next thread */
+};
+extern __thread struct mm_quick mm_quick;
+extern void *mm_quick_refill(unsigned int c);
+extern void mm_quick_flush(void);
+
+#define MM_QUICK_ENTER() do { \
+        __atomic_store_n(&mm_quick.busy, 1, __ATOMIC_RELAXED); \
+        __atomic_signal_fence(__ATOMIC_SEQ_CST); \
+    } while (0)
+#define MM_QUICK_LEAVE() __atomic_store_n(&mm_quick.busy, 0, __ATOMIC_RELEASE)
+#define MM_QUICK_DRAINING() __atomic_load_n(&mm_quick.drain, __ATOMIC_ACQUIRE)
+
+static inline void *mm_malloc_fast(size_t size) {
+    if (__builtin_constant_p(size) && size <= MM_QUICK_MAX) {
+        unsigned int c = MM_QUICK_CLASS(size);
+        void *p = NULL;
+        MM_QUICK_ENTER();
+        if (!MM_QUICK_DRAINING() && (p = mm_quick.head[c])) {
+            mm_quick.head[c] = *(void **)p;
+            mm_quick.count[c]--;
+        }
+        MM_QUICK_LEAVE();
+        return p ? p : mm_quick_refill(c);
+    }
+    return MM_MALLOC(size);
+}
+
+/* Blocks are only kept once the thread has refilled a quicklist, which
+   lets mm_maint_step find them. */
+static inline void mm_free_sized(void *ptr, size_t size) {
+    if (__builtin_constant_p(size) && size <= MM_QUICK_MAX && ptr) {
+        unsigned int c = MM_QUICK_CLASS(size);
+        int kept = 0;
+        MM_QUICK_ENTER();
+        if (!MM_QUICK_DRAINING() && mm_quick.gen &&
+            mm_quick.count[c] < MM_QUICK_LIMIT) {
+            *(void **)ptr = mm_quick.head[c];
+            mm_quick.head[c] = ptr;
+            mm_quick.count[c]++;
+            kept = 1;
+        }
+        MM_QUICK_LEAVE();
+        if (kept)
+            return;
+    }
+    MM_FREE(ptr);
+}
+
+/* Background maintenance. mm_maint_start runs mm_maint_step every
+   interval_ms in a thread of its own: the quicklists of threads that did
+   not refill one since the last step are emptied, up to purge_budget
+   bytes of pages inside free blocks of at least purge_min bytes are given
+   back to the OS, and free space at the end of the heap above trim_keep
+   bytes is released. */
+struct mm_maint_config {
+    unsigned int interval_ms;
+    size_t purge_budget;    /* most bytes purged per step */
+    size_t purge_min;
+    size_t trim_keep;
+};
+struct mm_maint_stats {
+    size_t steps;
+    size_t purged;          /* bytes given back with madvise */
+    size_t trimmed;         /* bytes given back from the end of the heap */
+    size_t drained;         /* blocks taken from idle threads' quicklists */
+};
+extern int mm_maint_start(const struct mm_maint_config *conf);
+extern void mm_maint_stop(void);
+extern void mm_maint_step(void);
+extern void mm_maint_stats(struct mm_maint_stats *stats);
+
+/* Sampled guard pages. After mm_guard_start one in about every rate
+   allocations of at most a page is placed at the end of a page of its own,
+   in front of an inaccessible one, and its page is made inaccessible when
+   it is freed. Overflows and uses after free then fault and are reported
+   on stderr, with the return addresses of the calls that allocated and
+   freed the block, before the process dies. The first call makes a pool
+   for slots blocks at a time, 0 for MM_GUARD_SLOTS, later calls only change
+   the rate. The pool lies in the space above the heap, which holds up to
+   32767 slots with 4 KB pages. A rate of 0 turns sampling off. Other
+   threads may take up to a million allocations to notice a new rate. Arena
+   chunks, pool slabs and the handle table are never sampled. Returns -1 if
+   the pool could not be made. */
+#define MM_GUARD_RATE 5000
+#define MM_GUARD_SLOTS 256
+struct mm_guard_stats {
+    size_t samples;         /* blocks placed in guard pages */
+    size_t live;
+    size_t slots;
+};
+extern int mm_guard_start(unsigned int rate, unsigned int slots);
+extern void mm_guard_stats(struct mm_guard_stats *stats);
+
+/* Search policy of a size class. Classes from 7 up, the ones holding
+   blocks of more than 56 bytes, look at up to lookahead blocks past the
+   first block that fits for a better one, 0 is first fit. The allocator
+   adjusts lookahead within bound from what its searches save. */
+#define MM_CLASSES 13
+struct mm_class_policy {
+    unsigned int lookahead;
+    unsigned int bound;     /* most lookahead at the current heap size */
+    unsigned long changes;  /* times lookahead was adjusted */
+    unsigned long searches;
+    unsigned long visited;  /* blocks looked at by all searches */
+    unsigned long splits;   /* blocks found that had to be split */
+    unsigned long saved;    /* bytes best fit saved over first fit */
+    size_t free_blocks;
+    size_t free_bytes;
+};
+extern int mm_get_class_policy(int cls, struct mm_class_policy *policy);
+
+/* Allocator statistics. Counts are totals since mm_init, a block counts
+   in the class of its own size and its bytes include its 8 byte header.
+   Blocks in quicklists are live, a realloc that resizes a block in place
+   counts as a free of the old block and an allocation of the new one.
+   The counters of a shared heap only count this process's calls. */
+struct mm_class_stats {
+    unsigned long allocs;
+    unsigned long frees;
+    size_t live_bytes;
+    size_t free_blocks;     /* on the free list now */
+    size_t free_bytes;
+    unsigned long splits;   /* blocks split to allocate one of this class */
+    unsigned long coalesces;/* neighbours merged with freed blocks */
+    unsigned long search_steps; /* free blocks looked at by searches */
+    unsigned long fallbacks;/* requests that went on to the last class */
+};
+struct mm_stats {
+    size_t heap_size;
+    size_t peak_heap;
+    unsigned long grows;    /* times the heap was extended */
+    size_t faulted;         /* bytes of new heap faulted in by malloc, none
+                               while MM_PREFAULT keeps ahead of the brk */
+    size_t live_bytes;      /* of all classes */
+    size_t peak_live;       /* most live_bytes when the heap grew or the
+                               counters were read */
+    struct mm_class_stats classes[MM_CLASSES];
+};
+extern void mm_get_stats(struct mm_stats *stats);
+
+/* Live statistics. From mm_stats_publish on the counters of mm_get_stats
+   are kept in a struct mm_stats_page mapped from the file at path, or
+   /dev/shm/mmstat.<pid> for NULL, where mmstat samples them while the
+   process runs. The file is removed when the process exits, a child made
+   by fork keeps its counters to itself. libmm.so publishes at startup if
+   MM_STATS is set, to the default file for 1 and to the file it names
+   otherwise. Returns -1 if the file could not be made. */
+#define MM_STATS_MAGIC 0x6d6d7374   /* "mmst" */
+struct mm_stats_page {
+    unsigned int magic;     /* set once the counters are in place */
+    unsigned int pid;
+    struct mm_stats stats;
+};
+extern int mm_stats_publish(const char *path);
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern int mm_checkheap(int verbose);
+
+/* Heap checking. Debug builds, and builds with -DHEAP_CHECK, check the
+   heap as they go at one of these levels:
+   MM_CHECK_OFF      nothing
+   MM_CHECK_LOCAL    the blocks each call touches and their neighbours
+   MM_CHECK_ROLLING  as LOCAL, and the next blocks blocks of the heap on
+                     every malloc, free and realloc, going round the heap
+   MM_CHECK_FULL     the whole heap and every free list, many times a call
+   Debug builds start at MM_CHECK_ROLLING, other builds with checking at
+   MM_CHECK_OFF. libmm.so reads MM_CHECK=<level>[,<blocks>[,<threads>]]
+   from the environment. mm_checkheap and MM_CHECK_FULL split the heap by
+   address over up to threads threads once it is large enough. The threads
+   are started by mm_set_check at MM_CHECK_FULL, or by mm_checkheap, and
+   wait for work from then on. 0 leaves blocks at MM_CHECK_BLOCKS and
+   threads at the number of CPUs. Returns -1
+   if the build has no checking and level is not MM_CHECK_OFF. */
+#define MM_CHECK_OFF 0
+#define MM_CHECK_LOCAL 1
+#define MM_CHECK_ROLLING 2
+#define MM_CHECK_FULL 3
+#define MM_CHECK_BLOCKS 64
+extern int mm_set_check(int level, unsigned int blocks, unsigned int threads);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,165 @@
+/*
+ * mm.hpp - C++ interface to the allocator in mm.c
+ *
+ * mm::allocator is a stateless allocator for standard containers.
+ * mm::pool_resource and mm::arena_resource are std::pmr memory resources
+ * backed by pools and by an arena. Linking mmnew.o as well routes the
+ * global operator new and delete through the allocator.
+ *
+ * Like malloc in mm.c, memory is 8 byte aligned unless a larger alignment
+ * is asked for explicitly.
+ */
+#ifndef MM_HPP
+#define MM_HPP
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+#include "mm.h"
+extern "C" {
+#include "memlib.h"
+}
+
+namespace mm {
+
+/* Sets up the heap once. The driver build runs on memlib's simulated
+   heap, which has to exist before the first allocation. */
+inline void init() {
+#ifdef DRIVER
+    static bool ready = false;
+    if (!ready) {
+        ready = true;
+        mem_init();
+        mm_init();
+    }
+#endif
+}
+
+/* Allocation with a known size. Small sizes go to the quicklists when
+   the size is a constant after inlining, over-aligned requests to
+   mm_memalign. */
+inline void *allocate(std::size_t size, std::size_t align = 8) {
+    void *p;
+    init();
+    if (align > 8)
+        p = mm_memalign(align, size);
+    else
+        p = mm_malloc_fast(size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+inline void deallocate(void *p, std::size_t size, std::size_t align = 8) {
+    if (align > 8)
+        MM_FREE(p);
+    else
+        mm_free_sized(p, size);
+}
+
+/* Stateless allocator for standard containers */
+template <class T>
+struct allocator {
+    typedef T value_type;
+
+    allocator() noexcept {}
+    template <class U>
+    allocator(const allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        return static_cast<T *>(mm::allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T *p, std::size_t n) noexcept {
+        mm::deallocate(p, n * sizeof(T), alignof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept { return true; }
+template <class T, class U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept { return false; }
+
+/* Memory resource that keeps a pool for every multiple of 8 bytes up to
+   MAX_POOLED and sends larger requests to the heap. Pools are created
+   on first use and their slabs go back to the heap with the resource. */
+class pool_resource : public std::pmr::memory_resource {
+public:
+    static const std::size_t MAX_POOLED = 256;
+
+    pool_resource() : pools_() {}
+    ~pool_resource() {
+        for (std::size_t i = 0; i < MAX_POOLED / 8; i++)
+            mm_pool_destroy(pools_[i]);
+    }
+    pool_resource(const pool_resource &) = delete;
+    pool_resource &operator=(const pool_resource &) = delete;
+
+private:
+    mm_pool *pools_[MAX_POOLED / 8];
+
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        void *p;
+        if (bytes == 0 || bytes > MAX_POOLED || align > 8)
+            return mm::allocate(bytes, align);
+        mm_pool *&pool = pools_[(bytes - 1) / 8];
+        init();
+        if (pool == nullptr && (pool = mm_pool_create((bytes + 7) & ~7, 8)) == nullptr)
+            throw std::bad_alloc();
+        if ((p = mm_pool_get(pool)) == nullptr)
+            throw std::bad_alloc();
+        return p;
+    }
+    void do_deallocate(void *p, std::size_t bytes, std::size_t align) override {
+        if (bytes == 0 || bytes > MAX_POOLED || align > 8)
+            MM_FREE(p);
+        else
+            mm_pool_put(pools_[(bytes - 1) / 8], p);
+    }
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+};
+
+/* Memory resource that bump-allocates from an arena. Deallocation does
+   nothing, release frees everything at once. */
+class arena_resource : public std::pmr::memory_resource {
+public:
+    explicit arena_resource(std::size_t chunk_size = 0) {
+        init();
+        if ((arena_ = mm_arena_create(chunk_size)) == nullptr)
+            throw std::bad_alloc();
+    }
+    ~arena_resource() { mm_arena_destroy(arena_); }
+    arena_resource(const arena_resource &) = delete;
+    arena_resource &operator=(const arena_resource &) = delete;
+
+    void release() { mm_arena_reset(arena_); }
+    struct mm_arena_stats stats() const {
+        struct mm_arena_stats s;
+        mm_arena_stats(arena_, &s);
+        return s;
+    }
+
+private:
+    mm_arena *arena_;
+
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        char *p;
+        if (align <= 8)
+            p = static_cast<char *>(mm_arena_alloc(arena_, bytes));
+        else if ((p = static_cast<char *>(mm_arena_alloc(arena_, bytes + align))))
+            p += (align - reinterpret_cast<std::size_t>(p) % align) % align;
+        if (p == nullptr)
+            throw std::bad_alloc();
+        return p;
+    }
+    void do_deallocate(void *, std::size_t, std::size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+};
+
+} // namespace mm
+
+#endif
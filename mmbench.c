@@ -0,0 +1,74 @@
+/*
+ * mmbench.c - microbenchmark for the small object paths of mm.c
+ *
+ * Times batches of allocations of a constant size followed by freeing
+ * them, and reports the cost of one malloc/free pair in ns for the plain
+ * mm_malloc/mm_free calls, the inline quicklist path, a pool and libc's
+ * malloc. Small batches fit in a quicklist, large ones do not.
+ *
+ * usage: mmbench [ops per test]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "ftimer.h"
+
+#define MAXBATCH 1000
+#define OPS 2000000
+
+static void *ptrs[MAXBATCH];
+static int batch, rounds, ops = OPS;
+static mm_pool *pool;
+
+#define BENCH(name, alloc, release)                 \
+static void name(void *arg) {                       \
+    int r, i;                                       \
+    (void)arg;                                      \
+    for (r = 0; r < rounds; r++) {                  \
+        for (i = 0; i < batch; i++)                 \
+            ptrs[i] = alloc;                        \
+        for (i = 0; i < batch; i++)                 \
+            release;                                \
+    }                                               \
+}
+
+BENCH(mm_16, mm_malloc(16), mm_free(ptrs[i]))
+BENCH(fast_16, mm_malloc_fast(16), mm_free_sized(ptrs[i], 16))
+BENCH(mm_48, mm_malloc(48), mm_free(ptrs[i]))
+BENCH(fast_48, mm_malloc_fast(48), mm_free_sized(ptrs[i], 48))
+BENCH(pool_48, mm_pool_get(pool), mm_pool_put(pool, ptrs[i]))
+BENCH(libc_48, malloc(48), free(ptrs[i]))
+
+static void run(const char *name, ftimer_test_funct f) {
+    double ns[2];
+    int i, batches[2] = {16, MAXBATCH};
+    for (i = 0; i < 2; i++) {
+        batch = batches[i];
+        rounds = ops / batch;
+        f(NULL); /* warm up, fills the heap and the quicklists */
+        ns[i] = ftimer_gettod(f, NULL, 5) * 1e9 / ((double)rounds * batch);
+    }
+    printf("%-8s %9.2f %9.2f\n", name, ns[0], ns[1]);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1)
+        ops = atoi(argv[1]);
+    mem_init();
+    if (mm_init() < 0)
+        return 1;
+    pool = mm_pool_create(48, 8);
+    printf("ns/op    %9s %9s\n", "batch 16", "batch 1000");
+    run("mm16", mm_16);
+    run("fast16", fast_16);
+    run("mm48", mm_48);
+    run("fast48", fast_48);
+    run("pool48", pool_48);
+    run("libc48", libc_48);
+    mm_pool_destroy(pool);
+    mm_quick_flush();
+    mem_deinit();
+    return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * mmcopy.c - bulk copy and zero for mm.c
+ *
+ * Copies and fills below mm_nt_threshold() bytes go to memcpy, memmove
+ * and memset. Larger ones would push the whole cache out for data that is
+ * not read again soon, so they use non-temporal stores that go around the
+ * cache, with the widest of SSE2, AVX2 and AVX-512 the CPU supports. The
+ * choice is made on the first large copy.
+ *
+ * The streaming loops copy upwards and load each vector before storing
+ * it, so they are safe for overlapping moves to a lower address, which is
+ * what realloc does when it merges with the block before. Moves to a
+ * higher address that overlap go to memmove.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NT_STORES
+#endif
+
+#include "mmcopy.h"
+
+/* Used when the size of the last level cache is unknown */
+#define NT_DEFAULT (4 << 20)
+
+size_t mm_bytes_copied;
+
+static size_t nt_threshold;
+
+/* Copies n bytes, a multiple of the vector size, to dst aligned to it */
+typedef void (*nt_copy_fn)(char *dst, const char *src, size_t n);
+typedef void (*nt_zero_fn)(char *dst, size_t n);
+
+static nt_copy_fn nt_copy;
+static nt_zero_fn nt_zero;
+static size_t nt_width;
+
+#ifdef NT_STORES
+static void copy_sse2(char *dst, const char *src, size_t n){
+    size_t i;
+    for(i = 0; i < n; i += 16)
+        _mm_stream_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+    _mm_sfence();
+}
+
+static void zero_sse2(char *dst, size_t n){
+    size_t i;
+    __m128i z = _mm_setzero_si128();
+    for(i = 0; i < n; i += 16)
+        _mm_stream_si128((__m128i*)(dst + i), z);
+    _mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(char *dst, const char *src, size_t n){
+    size_t i;
+    for(i = 0; i < n; i += 32)
+        _mm256_stream_si256((__m256i*)(dst + i), _mm256_loadu_si256((const __m256i*)(src + i)));
+    _mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static void zero_avx2(char *dst, size_t n){
+    size_t i;
+    __m256i z = _mm256_setzero_si256();
+    for(i = 0; i < n; i += 32)
+        _mm256_stream_si256((__m256i*)(dst + i), z);
+    _mm_sfence();
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512(char *dst, const char *src, size_t n){
+    size_t i;
+    for(i = 0; i < n; i += 64)
+        _mm512_stream_si512((__m512i*)(dst + i), _mm512_loadu_si512(src + i));
+    _mm_sfence();
+}
+
+__attribute__((target("avx512f")))
+static void zero_avx512(char *dst, size_t n){
+    size_t i;
+    __m512i z = _mm512_setzero_si512();
+    for(i = 0; i < n; i += 64)
+        _mm512_stream_si512((__m512i*)(dst + i), z);
+    _mm_sfence();
+}
+#endif
+
+//picks the streaming loops and the threshold, once
+static void nt_init(void){
+    long llc = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+#ifdef NT_THRESHOLD
+    nt_threshold = NT_THRESHOLD;
+#else
+    //half the cache is left to whatever else is using it
+    nt_threshold = llc > 0 ? (size_t)llc / 2 : NT_DEFAULT;
+#endif
+#ifdef NT_STORES
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")){
+        nt_copy = copy_avx512;
+        nt_zero = zero_avx512;
+        nt_width = 64;
+    } else if(__builtin_cpu_supports("avx2")){
+        nt_copy = copy_avx2;
+        nt_zero = zero_avx2;
+        nt_width = 32;
+    } else {
+        nt_copy = copy_sse2;
+        nt_zero = zero_sse2;
+        nt_width = 16;
+    }
+#else
+    nt_threshold = SIZE_MAX;
+#endif
+}
+
+//copies and fills of at least this many bytes bypass the cache
+size_t mm_nt_threshold(void){
+    if(nt_threshold == 0)
+        nt_init();
+    return nt_threshold;
+}
+
+/* Streams n bytes from src to a lower or non-overlapping dst. The bytes
+ * up to the first aligned address of dst and the tail that does not fill
+ * a vector are copied with memmove.
+ */
+static void stream(char *dst, const char *src, size_t n){
+    size_t head = -(uintptr_t)dst & (nt_width - 1);
+    size_t body = (n - head) & ~(nt_width - 1);
+    memmove(dst, src, head);
+    nt_copy(dst + head, src + head, body);
+    memmove(dst + head + body, src + head + body, n - head - body);
+}
+
+//memcpy for buffers that do not overlap
+void mm_copy(void *dst, const void *src, size_t n){
+    mm_bytes_copied += n;
+    if(n < mm_nt_threshold())
+        memcpy(dst, src, n);
+    else
+        stream(dst, src, n);
+}
+
+//memmove, overlapping buffers are allowed
+void mm_move(void *dst, const void *src, size_t n){
+    mm_bytes_copied += n;
+    if(n < mm_nt_threshold() || ((char*)dst > (char*)src && (char*)dst < (char*)src + n))
+        memmove(dst, src, n);
+    else
+        stream(dst, src, n);
+}
+
+//memset to 0
+void mm_zero(void *dst, size_t n){
+    char *d = dst;
+    size_t head, body;
+    if(n < mm_nt_threshold()){
+        memset(dst, 0, n);
+        return;
+    }
+    head = -(uintptr_t)d & (nt_width - 1);
+    body = (n - head) & ~(nt_width - 1);
+    memset(d, 0, head);
+    nt_zero(d + head, body);
+    memset(d + head + body, 0, n - head - body);
+}
@@ -0,0 +1,14 @@
+/*
+ * mmcopy.h - bulk copy and zero for mm.c
+ */
+#include <stddef.h>
+
+/* Bytes moved by mm_copy and mm_move since the last reset, for reporting
+   what realloc costs. Updated without locking, mm.c only calls these
+   while it holds its lock. */
+extern size_t mm_bytes_copied;
+
+void mm_copy(void *dst, const void *src, size_t n);
+void mm_move(void *dst, const void *src, size_t n);
+void mm_zero(void *dst, size_t n);
+size_t mm_nt_threshold(void);
@@ -0,0 +1,243 @@
+/*
+ * mmguard.c - sampled guard page allocations for mm.c
+ *
+ * One allocation in about every rate is served from a pool of pages set
+ * apart from the heap, each with an inaccessible page on either side. The
+ * pool is the space memlib keeps above the heap, see mem_spare, so a
+ * sampled block has a 32 bit offset from the heap like any other. The
+ * block is placed at the end of its page, so running off its end faults
+ * on the next guard page. A freed block's page is made inaccessible too
+ * and goes to the back of the queue of free pages, so it stays that way
+ * for as long as possible before it is handed out again. The SIGSEGV
+ * handler reports faults in the pool with the addresses of the code that
+ * allocated and freed the block, then lets the signal kill the process.
+ * Freeing a block twice, or a pointer into its middle, is reported and
+ * aborts.
+ *
+ * The distance between samples is random, with a mean of rate, so that
+ * allocations made in a fixed pattern are not always missed. Blocks larger
+ * than a page are not sampled, and neither are the up to 7 bytes between
+ * the end of an 8 byte aligned block and its guard page.
+ *
+ * mm.c calls these with its lock held, except for mm_guard_owns, which
+ * only reads mm_guard_lo and mm_guard_hi. The sites are return addresses,
+ * addr2line turns them into source lines.
+ */
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mmguard.h"
+
+/* A thread with sampling off looks again after this many allocations */
+#define GUARD_IDLE (1L << 20)
+
+#define UNUSED 0
+#define LIVE 1
+#define FREED 2
+
+struct slot {
+    char *ptr;
+    size_t size;
+    void *alloc_site, *free_site;
+    int state;
+    unsigned int next;      //in the queue of free slots
+};
+
+char *mm_guard_lo, *mm_guard_hi;
+__thread long mm_guard_next;
+static __thread unsigned int seed;
+
+static unsigned int rate;
+static struct slot *slots;
+static unsigned int maxslots, nslots, head, tail, nfree;
+static char *space;         //where the pool goes, see mm_guard_reset
+static size_t room;
+static size_t page, samples, live;
+static struct sigaction old_segv;
+
+static void report(const char *what, const struct slot *s, const char *addr) {
+    char buf[256];
+    int n;
+    if (addr < s->ptr)
+        n = snprintf(buf, sizeof(buf), "mm: %s %zu bytes before the %zu byte "
+                     "block at %p\n", what, (size_t)(s->ptr - addr), s->size, s->ptr);
+    else if (addr >= s->ptr + s->size)
+        n = snprintf(buf, sizeof(buf), "mm: %s %zu bytes past the end of the %zu "
+                     "byte block at %p\n", what, (size_t)(addr - s->ptr - s->size),
+                     s->size, s->ptr);
+    else
+        n = snprintf(buf, sizeof(buf), "mm: %s at %p, %zu bytes into the %zu byte "
+                     "block at %p\n", what, addr, (size_t)(addr - s->ptr), s->size, s->ptr);
+    write(STDERR_FILENO, buf, n);
+    n = snprintf(buf, sizeof(buf), "    allocated by %p", s->alloc_site);
+    if (s->state == FREED)
+        n += snprintf(buf + n, sizeof(buf) - n, ", freed by %p", s->free_site);
+    buf[n++] = '\n';
+    write(STDERR_FILENO, buf, n);
+}
+
+//the slot whose page holds addr, or whose block is closest to it
+static struct slot *nearest(const char *addr) {
+    size_t i = (addr - mm_guard_lo) / page;
+    struct slot *left, *right;
+    if (i % 2)
+        return &slots[i / 2];
+    left = i >= 2 ? &slots[i / 2 - 1] : NULL;
+    right = i / 2 < nslots ? &slots[i / 2] : NULL;
+    if (left && left->state != UNUSED &&
+            (right == NULL || right->state == UNUSED ||
+             addr - (left->ptr + left->size) < right->ptr - addr))
+        return left;
+    return right && right->state != UNUSED ? right : NULL;
+}
+
+static void on_segv(int sig, siginfo_t *info, void *ctx) {
+    char *addr = info->si_addr;
+    struct slot *s;
+    if (mm_guard_owns(addr) && (s = nearest(addr))) {
+        if (s->state == FREED)
+            report("use after free", s, addr);
+        else if (addr < s->ptr)
+            report("buffer underflow", s, addr);
+        else
+            report("buffer overflow", s, addr);
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+    //not ours, the fault happens again under the handler that was there
+    if (old_segv.sa_flags & SA_SIGINFO)
+        old_segv.sa_sigaction(sig, info, ctx);
+    else if (old_segv.sa_handler != SIG_DFL && old_segv.sa_handler != SIG_IGN)
+        old_segv.sa_handler(sig);
+    else
+        sigaction(SIGSEGV, &old_segv, NULL);
+}
+
+/* Samples one in about every rate allocations from then on, 0 turns
+ * sampling off. The first call makes the pool with room for slots blocks
+ * at a time, or as many as fit in the space mm_guard_reset was given,
+ * later calls only change the rate. Returns -1 if the pool could not be
+ * made.
+ */
+int mm_guard_setup(unsigned int r, unsigned int n) {
+    struct sigaction sa;
+    if (slots == NULL && r) {
+        page = sysconf(_SC_PAGESIZE);
+        if (room < 3 * page)
+            return -1;
+        if (n > (room / page - 1) / 2)
+            n = (room / page - 1) / 2;
+        if ((slots = calloc(n, sizeof(struct slot))) == NULL)
+            return -1;
+        maxslots = n;
+        mm_guard_reset(space, room);
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = on_segv;
+        sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGSEGV, &sa, &old_segv);
+    }
+    rate = r;
+    mm_guard_next = 0;
+    return 0;
+}
+
+/* Forgets every block, for a heap that starts over, and moves the pool to
+ * the len bytes at at, which are inaccessible. With less room than the
+ * pool had, it keeps as many slots as fit.
+ */
+void mm_guard_reset(char *at, size_t len) {
+    unsigned int i;
+    space = at;
+    room = len;
+    if (slots == NULL)
+        return;
+    nslots = at && len >= 3 * page ? (len / page - 1) / 2 : 0;
+    if (nslots > maxslots)
+        nslots = maxslots;
+    mm_guard_lo = nslots ? at : NULL;
+    mm_guard_hi = nslots ? at + (2 * (size_t)nslots + 1) * page : NULL;
+    if (nslots)
+        mprotect(mm_guard_lo, mm_guard_hi - mm_guard_lo, PROT_NONE);
+    for (i = 0; i < nslots; i++) {
+        slots[i].state = UNUSED;
+        slots[i].next = i + 1;
+    }
+    head = 0;
+    tail = nslots ? nslots - 1 : 0;
+    nfree = nslots;
+    live = 0;
+}
+
+/* Serves size bytes from the pool, or returns NULL if the block can not be
+ * sampled and mm.c has to allocate it. Sets how many allocations the
+ * thread makes before the next sample.
+ */
+void *mm_guard_alloc(size_t size, void *site) {
+    struct slot *s;
+    char *p;
+    if (rate == 0) {
+        mm_guard_next = GUARD_IDLE;
+        return NULL;
+    }
+    if (seed == 0)
+        seed = (uintptr_t)&mm_guard_next | 1;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    mm_guard_next = 1 + seed % (2 * rate);
+    if (size > page || nfree == 0)
+        return NULL;
+    s = &slots[head];
+    p = mm_guard_lo + (2 * (size_t)head + 1) * page;
+    if (mprotect(p, page, PROT_READ | PROT_WRITE) < 0)
+        return NULL;
+    head = s->next;
+    nfree--;
+    s->size = size ? size : 1;
+    s->ptr = p + page - ((s->size + 7) & ~(size_t)7);
+    s->alloc_site = site;
+    s->state = LIVE;
+    samples++;
+    live++;
+    return s->ptr;
+}
+
+void mm_guard_free(void *p, void *site) {
+    size_t i = ((char *)p - mm_guard_lo) / page;
+    struct slot *s = &slots[i / 2];
+    if (i % 2 == 0 || s->state != LIVE || (char *)p != s->ptr) {
+        if (i % 2 && s->state != UNUSED)
+            report(s->state == FREED ? "double free" : "free of a pointer", s, p);
+        else
+            fprintf(stderr, "mm: free of %p, which was not allocated\n", p);
+        abort();
+    }
+    mprotect(mm_guard_lo + i * page, page, PROT_NONE);
+    s->free_site = site;
+    s->state = FREED;
+    s->next = nslots;
+    if (nfree)
+        slots[tail].next = i / 2;
+    else
+        head = i / 2;
+    tail = i / 2;
+    nfree++;
+    live--;
+}
+
+//the size a sampled block was allocated with
+size_t mm_guard_size(const void *p) {
+    return slots[((const char *)p - mm_guard_lo) / page / 2].size;
+}
+
+void mm_guard_counts(size_t *s, size_t *l, size_t *n) {
+    *s = samples;
+    *l = live;
+    *n = nslots;
+}
@@ -0,0 +1,24 @@
+/*
+ * mmguard.h - sampled guard page allocations for mm.c
+ */
+#include <stddef.h>
+
+/* The pages of the pool, NULL until mm_guard_setup makes it, or if it has
+   no room */
+extern char *mm_guard_lo, *mm_guard_hi;
+
+/* Allocations the calling thread makes before it samples one, mm.c
+   counts it down and calls mm_guard_alloc when it reaches 0 */
+extern __thread long mm_guard_next;
+
+//whether p was handed out by mm_guard_alloc
+static inline int mm_guard_owns(const void *p) {
+    return (const char *)p >= mm_guard_lo && (const char *)p < mm_guard_hi;
+}
+
+int mm_guard_setup(unsigned int rate, unsigned int slots);
+void mm_guard_reset(char *at, size_t len);
+void *mm_guard_alloc(size_t size, void *site);
+void mm_guard_free(void *p, void *site);
+size_t mm_guard_size(const void *p);
+void mm_guard_counts(size_t *samples, size_t *live, size_t *slots);
@@ -0,0 +1,93 @@
+/*
+ * mmnew.cpp - global operator new and delete on top of mm.c
+ *
+ * Link this in to send every new and delete of a program to the
+ * allocator, aligned forms use mm_memalign. The operators are out of
+ * line, so their size is never known at compile time and the quicklists
+ * of mm.h are not used: new ends up in malloc and sized deletes in plain
+ * free. Containers get them through mm::allocator, see mm.hpp, where
+ * mm::allocate is inlined and a constant size can reach them.
+ */
+#include <new>
+
+#include "mm.hpp"
+
+void *operator new(std::size_t size) {
+    return mm::allocate(size);
+}
+
+void *operator new[](std::size_t size) {
+    return mm::allocate(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return mm::allocate(size);
+    } catch (const std::bad_alloc &) {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return operator new(size, std::nothrow);
+}
+
+void *operator new(std::size_t size, std::align_val_t align) {
+    return mm::allocate(size, static_cast<std::size_t>(align));
+}
+
+void *operator new[](std::size_t size, std::align_val_t align) {
+    return mm::allocate(size, static_cast<std::size_t>(align));
+}
+
+void *operator new(std::size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+    try {
+        return mm::allocate(size, static_cast<std::size_t>(align));
+    } catch (const std::bad_alloc &) {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+    return operator new(size, align, std::nothrow);
+}
+
+void operator delete(void *p) noexcept {
+    MM_FREE(p);
+}
+
+void operator delete[](void *p) noexcept {
+    MM_FREE(p);
+}
+
+void operator delete(void *p, std::size_t size) noexcept {
+    mm::deallocate(p, size);
+}
+
+void operator delete[](void *p, std::size_t size) noexcept {
+    mm::deallocate(p, size);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    MM_FREE(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+    MM_FREE(p);
+}
+
+void operator delete(void *p, std::size_t size, std::align_val_t align) noexcept {
+    mm::deallocate(p, size, static_cast<std::size_t>(align));
+}
+
+void operator delete[](void *p, std::size_t size, std::align_val_t align) noexcept {
+    mm::deallocate(p, size, static_cast<std::size_t>(align));
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+    MM_FREE(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    MM_FREE(p);
+}
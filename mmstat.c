@@ -0,0 +1,133 @@
+/*
+ * mmstat.c - samples the statistics a process publishes with
+ * mm_stats_publish, or through MM_STATS when it runs with libmm.so
+ *
+ * Like vmstat, prints a line every interval seconds, count times or until
+ * the process exits. The first line shows the totals since the heap was
+ * made, the ones after it the rates over the last interval. The columns
+ * are the heap size, the bytes in allocated blocks, fragmentation as the
+ * part of the heap not allocated, allocations, frees and heap extensions
+ * per second, and the number of blocks on the free list of each class.
+ *
+ * The counters change while they are read, each one is read with a
+ * relaxed atomic load, so a line may mix counts from just before and just
+ * after a call to malloc or free.
+ *
+ * usage: mmstat <pid|file> [interval [count]]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mm.h"
+
+#define HEADER_EVERY 20
+
+//copies the counters, one word at a time
+static void snap(const struct mm_stats_page *page, struct mm_stats *st) {
+    const unsigned long *from = (const unsigned long *)&page->stats;
+    unsigned long *to = (unsigned long *)st;
+    size_t i;
+    for (i = 0; i < sizeof(*st) / sizeof(unsigned long); i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+static unsigned long total(const struct mm_stats *st, int frees) {
+    unsigned long n = 0;
+    int i;
+    for (i = 0; i < MM_CLASSES; i++)
+        n += frees ? st->classes[i].frees : st->classes[i].allocs;
+    return n;
+}
+
+static void header(void) {
+    char name[8];
+    int i;
+    printf("%9s %9s %5s %9s %9s %6s ", "heapKB", "liveKB", "frag",
+           "allocs/s", "frees/s", "grow/s");
+    for (i = 0; i < MM_CLASSES; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        printf(" %6s", name);
+    }
+    printf("\n");
+}
+
+/* Prints a line for st, with rates over secs seconds since last, or the
+ * totals if last is NULL */
+static void line(const struct mm_stats *st, const struct mm_stats *last,
+                 double secs) {
+    double frag = st->heap_size ?
+        100.0 * (1.0 - (double)st->live_bytes / st->heap_size) : 0;
+    unsigned long allocs = total(st, 0), frees = total(st, 1), grows = st->grows;
+    int i;
+    if (last) {
+        allocs = (allocs - total(last, 0)) / secs;
+        frees = (frees - total(last, 1)) / secs;
+        grows = (grows - last->grows) / secs;
+    }
+    printf("%9zu %9zu %4.1f%% %9lu %9lu %6lu ", st->heap_size >> 10,
+           st->live_bytes >> 10, frag, allocs, frees, grows);
+    for (i = 0; i < MM_CLASSES; i++)
+        printf(" %6zu", st->classes[i].free_blocks);
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    struct mm_stats_page *page;
+    struct mm_stats st, last;
+    char path[256];
+    unsigned int interval = 1;
+    long count = -1, n;
+    char *end;
+    int fd;
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: mmstat <pid|file> [interval [count]]\n");
+        return 1;
+    }
+    strtol(argv[1], &end, 10);
+    if (*end == '\0')
+        snprintf(path, sizeof(path), "/dev/shm/mmstat.%s", argv[1]);
+    else
+        snprintf(path, sizeof(path), "%s", argv[1]);
+    if (argc > 2 && (interval = atoi(argv[2])) == 0) {
+        fprintf(stderr, "mmstat: interval must be at least 1 second\n");
+        return 1;
+    }
+    if (argc > 3)
+        count = atol(argv[3]);
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        perror(path);
+        return 1;
+    }
+    page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        perror(path);
+        return 1;
+    }
+    if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != MM_STATS_MAGIC) {
+        fprintf(stderr, "mmstat: %s holds no statistics\n", path);
+        return 1;
+    }
+
+    for (n = 0; count < 0 || n < count; n++) {
+        if (n > 0)
+            sleep(interval);
+        if (kill(page->pid, 0) < 0 && errno == ESRCH) {
+            fprintf(stderr, "mmstat: process %u exited\n", page->pid);
+            break;
+        }
+        if (n % HEADER_EVERY == 0)
+            header();
+        snap(page, &st);
+        line(&st, n ? &last : NULL, interval);
+        last = st;
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * persisttest.c - tests that a persistent heap of mm.c survives crashes
+ *
+ * Each round a forked child opens the heap file, checks that it holds
+ * the list of items the round before synced, and replaces the list with
+ * a new one that it syncs with mm_sync_persistent. It then frees and
+ * overwrites items, allocates more and dies with _exit without syncing
+ * again. The next round has to find the list as it was synced, and the
+ * heap sound. Exits with 1 at the first failure.
+ *
+ * usage: persisttest [rounds [items]]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "mm.h"
+
+struct item {
+    uint32_t next;      /* offset of the next item, 0 ends the list */
+    uint32_t round, seq, size;
+    unsigned char fill[];
+};
+
+static int rounds = 20, items = 2000;
+
+static unsigned char fill_byte(uint32_t round, uint32_t seq) {
+    return (round * 31 + seq * 7) & 0xff;
+}
+
+//returns 0 if the list at the root is the one round r synced
+static int check_list(uint32_t r) {
+    struct item *it = mm_get_root();
+    uint32_t seq = 0, i;
+    for (; it; it = mm_off_to_ptr(it->next), seq++) {
+        if (it->round != r || it->seq != seq ||
+                it->size != 1 + (seq * 53 + r) % 1500)
+            return -1;
+        for (i = 0; i < it->size; i++)
+            if (it->fill[i] != fill_byte(r, seq))
+                return -1;
+    }
+    return seq == (uint32_t)items ? 0 : -1;
+}
+
+//builds the list of round r from its end, freeing the one before
+static int build_list(uint32_t r) {
+    struct item *it = mm_get_root(), *next = NULL;
+    uint32_t seq, size;
+    for (; it; it = next) {
+        next = mm_off_to_ptr(it->next);
+        mm_free(it);
+    }
+    for (seq = items; seq-- > 0; next = it) {
+        size = 1 + (seq * 53 + r) % 1500;
+        if ((it = mm_malloc(sizeof(*it) + size)) == NULL)
+            return -1;
+        it->next = mm_ptr_to_off(next);
+        it->round = r;
+        it->seq = seq;
+        it->size = size;
+        memset(it->fill, fill_byte(r, seq), size);
+    }
+    mm_set_root(next);
+    return 0;
+}
+
+//one round, run in its own process
+static int round_of(const char *path, uint32_t r) {
+    struct item *it, *next;
+    void *junk[64];
+    int i;
+    if (mm_open_persistent(path) < 0)
+        return fprintf(stderr, "round %u: open failed\n", r), 1;
+    if (r > 0 && check_list(r - 1) < 0)
+        return fprintf(stderr, "round %u: list of the last sync lost\n", r), 1;
+    if (mm_checkheap(0))
+        return fprintf(stderr, "round %u: heap corrupt\n", r), 1;
+    if (build_list(r) < 0 || mm_sync_persistent() < 0)
+        return fprintf(stderr, "round %u: sync failed\n", r), 1;
+
+    //changes that the crash must throw away
+    for (it = mm_get_root(), i = 0; it; it = next, i++) {
+        next = mm_off_to_ptr(it->next);
+        if (i % 3 == 0)
+            memset(it->fill, 0xee, it->size);
+        else if (i % 3 == 1)
+            mm_free(it);
+    }
+    for (i = 0; i < 64; i++)
+        junk[i] = mm_malloc(1 + i * 211);
+    mm_set_root(junk[0]);
+    _exit(0);
+}
+
+int main(int argc, char **argv) {
+    char path[] = "/tmp/persisttestXXXXXX";
+    int fd, r, status;
+    pid_t pid;
+    if (argc > 1)
+        rounds = atoi(argv[1]);
+    if (argc > 2)
+        items = atoi(argv[2]);
+    if ((fd = mkstemp(path)) < 0)
+        return perror("mkstemp"), 1;
+    close(fd);
+    for (r = 0; r <= rounds; r++) {
+        if ((pid = fork()) == 0)
+            _exit(round_of(path, r));
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+                WEXITSTATUS(status)) {
+            unlink(path);
+            return 1;
+        }
+    }
+    unlink(path);
+    printf("%d rounds of %d items survived a crash after the sync\n",
+           rounds, items);
+    return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * shmtest.c - tests the shared heap of mm.c with several processes
+ *
+ * Four forked writers allocate messages in a heap opened with
+ * mm_open_shared and pass them to the next writer as offsets, through
+ * mailboxes the parent allocated in the heap. Each writer checks and
+ * frees the messages passed to it. Then workers looping over malloc and
+ * free are killed with SIGKILL at random points, most of them while they
+ * hold the heap's lock, and after each one the parent has to be able to
+ * use the heap and find it sound.
+ *
+ * Exits with 1 at the first failure.
+ *
+ * usage: shmtest [messages per writer [kills]]
+ */
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "mm.h"
+
+#define WRITERS 4
+#define SLOTS 64
+#define KEEP 32
+
+struct message {
+    uint32_t from, seq, size;
+    unsigned char fill[];
+};
+
+static uint32_t (*mailbox)[SLOTS];
+static int messages = 20000, kills = 20;
+
+static unsigned char fill_byte(uint32_t from, uint32_t seq) {
+    return (from * 31 + seq) & 0xff;
+}
+
+//checks and frees the message at off, returns -1 if it is not intact
+static int receive(int to, uint32_t off) {
+    struct message *m = mm_off_to_ptr(off);
+    unsigned char c = fill_byte(m->from, m->seq);
+    uint32_t i;
+    if (m->from != (uint32_t)(to + WRITERS - 1) % WRITERS)
+        return -1;
+    for (i = 0; i < m->size; i++)
+        if (m->fill[i] != c)
+            return -1;
+    mm_free(m);
+    return 0;
+}
+
+//sends messages to the next writer and takes those of the one before
+static int writer(int me) {
+    uint32_t *out = mailbox[(me + 1) % WRITERS], *in = mailbox[me], off;
+    struct message *m = NULL;
+    int sent = 0, received = 0, j;
+    while (sent < messages || received < messages) {
+        if (sent < messages && m == NULL) {
+            uint32_t size = 1 + (sent * 37 + me * 101) % 2000;
+            if ((m = mm_malloc(sizeof(*m) + size)) == NULL)
+                return 1;
+            m->from = me;
+            m->seq = sent;
+            m->size = size;
+            memset(m->fill, fill_byte(me, sent), size);
+        }
+        off = m ? mm_ptr_to_off(m) : 0;
+        if (m && __sync_bool_compare_and_swap(&out[sent % SLOTS], 0, off)) {
+            m = NULL;
+            sent++;
+        }
+        for (j = 0; j < SLOTS; j++) {
+            if ((off = __atomic_exchange_n(&in[j], 0, __ATOMIC_ACQ_REL)) == 0)
+                continue;
+            if (receive(me, off) < 0)
+                return 1;
+            received++;
+        }
+    }
+    return 0;
+}
+
+//allocates and frees until it is killed
+static void worker(unsigned int seed) {
+    void *keep[KEEP] = {0};
+    int i;
+    for (;;) {
+        i = rand_r(&seed) % KEEP;
+        mm_free(keep[i]);
+        keep[i] = mm_malloc(1 + rand_r(&seed) % 3000);
+    }
+}
+
+static int fail(const char *what) {
+    fprintf(stderr, "shmtest: %s\n", what);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    pid_t pid[WRITERS];
+    void *p[KEEP];
+    int i, k, status, ok = 1;
+    unsigned int seed = getpid();
+    if (argc > 1)
+        messages = atoi(argv[1]);
+    if (argc > 2)
+        kills = atoi(argv[2]);
+    if (mm_open_shared(NULL) < 0)
+        return fail("mm_open_shared failed");
+    mailbox = mm_malloc(sizeof(uint32_t[WRITERS][SLOTS]));
+    memset(mailbox, 0, sizeof(uint32_t[WRITERS][SLOTS]));
+
+    for (i = 0; i < WRITERS; i++)
+        if ((pid[i] = fork()) == 0)
+            _exit(writer(i));
+    for (i = 0; i < WRITERS; i++)
+        if (waitpid(pid[i], &status, 0) < 0 || !WIFEXITED(status) ||
+                WEXITSTATUS(status))
+            ok = 0;
+    if (!ok)
+        return fail("a writer found a damaged message or ran out of memory");
+    if (mm_checkheap(0))
+        return fail("heap corrupt after the writers");
+    printf("%d writers passed %d messages each\n", WRITERS, messages);
+
+    for (k = 0; k < kills; k++) {
+        if ((pid[0] = fork()) == 0)
+            worker(seed + k);
+        usleep(1000 + rand_r(&seed) % 5000);
+        kill(pid[0], SIGKILL);
+        waitpid(pid[0], &status, 0);
+        for (i = 0; i < KEEP; i++)
+            p[i] = mm_malloc(1 + i * 97);
+        for (i = 0; i < KEEP; i++)
+            mm_free(p[i]);
+        if (mm_checkheap(0))
+            return fail("heap corrupt after a worker was killed");
+    }
+    printf("the heap survived %d workers killed while allocating\n", kills);
+    return 0;
+}